@@ -0,0 +1,158 @@
+#pragma once
+
+#include <nix/util/error.hh>
+
+#include <array>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// In-process decryption of age v1 files (https://age-encryption.org/v1).
+//
+// Only the recipient types listed in parseIdentities() are handled here.
+// Anything else (passphrase-protected keys, scrypt, ssh-ed25519, ...) is left
+// to the age binary, so every function reports "not handled" rather than
+// failing when it meets something it does not understand.
+
+namespace mini_agenix {
+
+using nix::Error;
+
+MakeError(AgeError, Error);
+
+using FileKey = std::array<unsigned char, 16>;
+
+struct AgeStanza
+{
+    std::string type;
+    std::vector<std::string> args;
+    std::string body;
+};
+
+struct AgeHeader
+{
+    std::vector<AgeStanza> stanzas;
+    // Header bytes up to and including "---", which the MAC covers.
+    std::string_view macInput;
+    std::string mac;
+    // Offset of the payload (nonce and STREAM chunks) in the file.
+    size_t payloadOffset;
+};
+
+// Parse the binary header of an age file. Returns std::nullopt if the
+// data is not a binary age v1 file; throws AgeError if it is one but the
+// header is malformed.
+std::optional<AgeHeader> parseHeader(std::string_view data);
+
+struct AgeIdentity
+{
+    virtual ~AgeIdentity() = default;
+
+    // Returns std::nullopt if the stanza is not addressed to this identity.
+    virtual std::optional<FileKey> unwrap(const AgeStanza & stanza) const = 0;
+};
+
+using AgeIdentities = std::vector<std::shared_ptr<const AgeIdentity>>;
+
+struct ParsedIdentities
+{
+    AgeIdentities identities;
+    // AGE-PLUGIN-<NAME>-1 identities, by plugin name.
+    std::map<std::string, std::vector<std::string>> plugins;
+    // False if the file contained keys that can only be used through the
+    // age binary.
+    bool complete = true;
+};
+
+// Parse the contents of an identity file: an age identity file with
+// AGE-SECRET-KEY-1 (X25519) and AGE-SECRET-KEY-PQ-1 (ML-KEM-768 + X25519,
+// with libcrypto 3.5 or later) lines, or an unencrypted ssh-rsa private
+// key in OpenSSH or PEM format. Key derivations that only depend on the
+// private key (RSA CRT parameters, X25519 public keys, the expanded
+// ML-KEM key) are done here once.
+ParsedIdentities parseIdentities(std::string_view contents);
+
+// An identity for passphrase-encrypted (scrypt) files.
+std::shared_ptr<const AgeIdentity> scryptIdentity(std::string passphrase);
+
+// Check the header MAC with an unwrapped file key.
+bool verifyHeaderMac(const AgeHeader & header, const FileKey & fileKey);
+
+// Unwrap the file key with the first matching identity and check the
+// header MAC. Returns std::nullopt if no identity matches.
+std::optional<FileKey> unwrapFileKey(const AgeHeader & header, const AgeIdentities & identities);
+
+// Decrypt and authenticate the payload that follows the header.
+std::string decryptPayload(const FileKey & fileKey, std::string_view payload);
+
+// The size of the plaintext of a payload, without decrypting it.
+uint64_t payloadSize(std::string_view payload);
+
+// Like decryptPayload, into `out`, which must have room for
+// payloadSize(payload) bytes. `out` is wiped if decryption fails.
+void decryptPayloadInto(const FileKey & fileKey, std::string_view payload, char * out);
+
+// Decrypt the plaintext bytes [offset, offset + length) of the payload.
+// Only the STREAM chunks overlapping that range are decrypted and
+// authenticated. Throws AgeError if the range is out of bounds.
+std::string decryptPayloadRange(const FileKey & fileKey, std::string_view payload, uint64_t offset, uint64_t length);
+
+// A file in age's ASCII armor (age --armor). Only the header is decoded
+// when parsing; the payload is decoded as it is decrypted.
+struct ArmoredAge
+{
+    // The decoded header, up to and including the MAC line.
+    std::string header;
+    // The base64 lines between the BEGIN and END lines.
+    std::string_view body;
+    // The length of a full line, with its line ending.
+    size_t stride;
+    // The size of the binary file.
+    uint64_t size;
+};
+
+// Parse an armored age file. Returns std::nullopt if the data is not
+// armored, or not laid out in full 64-column lines with one kind of line
+// ending; throws AgeError if its base64 is invalid or its header is
+// truncated. parseHeader(armored.header) parses the header.
+std::optional<ArmoredAge> parseArmor(std::string_view data);
+
+// Decrypt and authenticate the payload of an armored file. Each STREAM
+// chunk is decoded into a reused buffer just before it is decrypted, so
+// the binary file is never materialised.
+std::string decryptArmoredPayload(const FileKey & fileKey, const ArmoredAge & armored);
+
+// The size of the plaintext of an armored file, without decrypting it.
+uint64_t armoredPayloadSize(const ArmoredAge & armored);
+
+// Like decryptArmoredPayload, into `out`, which must have room for
+// armoredPayloadSize(armored) bytes. `out` is wiped if decryption fails.
+void decryptArmoredPayloadInto(const FileKey & fileKey, const ArmoredAge & armored, char * out);
+
+// Like decryptPayloadRange, for an armored file. Only the lines holding
+// the chunks that overlap the range are decoded.
+std::string
+decryptArmoredPayloadRange(const FileKey & fileKey, const ArmoredAge & armored, uint64_t offset, uint64_t length);
+
+// Decode an armored file into the binary file.
+std::string dearmor(const ArmoredAge & armored);
+
+struct PluginResult
+{
+    // One entry per header, empty if the plugin could not unwrap it.
+    std::vector<std::optional<FileKey>> fileKeys;
+    // Errors the plugin reported, and prompts it was refused.
+    std::vector<std::string> errors;
+};
+
+// Run one identity-v1 session of age-plugin-<name>
+// (https://c2sp.org/age-plugin) for any number of files. The protocol
+// lets a single plugin process unwrap the stanzas of many headers, so
+// batches pay for the plugin's startup and handshake only once.
+PluginResult
+unwrapWithPlugin(const std::string & name, const std::vector<std::string> & identities, const std::vector<const AgeHeader *> & headers);
+
+} // namespace mini_agenix
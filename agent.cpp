@@ -0,0 +1,123 @@
+#include "agent.hh"
+
+#include <nix/util/environment-variables.hh>
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/logging.hh>
+#include <nix/util/serialise.hh>
+
+#include <openssl/crypto.h>
+
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace mini_agenix {
+
+using namespace nix;
+
+std::filesystem::path userRuntimeDir()
+{
+    if (auto runtimeDir = getEnv("XDG_RUNTIME_DIR"))
+        return std::filesystem::path(*runtimeDir) / "mini-agenix";
+    return std::filesystem::path("/tmp") / ("mini-agenix-" + std::to_string(getuid()));
+}
+
+void ensurePrivateDir(const std::filesystem::path & dir)
+{
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+        throw SysError("creating directory '%s'", dir.string());
+    struct stat st;
+    if (lstat(dir.c_str(), &st) == -1)
+        throw SysError("getting status of '%s'", dir.string());
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
+        throw Error("'%s' must be a directory owned by the current user and not accessible to others", dir.string());
+}
+
+std::filesystem::path agentSocketPath()
+{
+    if (auto env = getEnv("MINI_AGENIX_AGENT_SOCKET"))
+        return *env;
+    return userRuntimeDir() / "agent.sock";
+}
+
+// Connects to the agent, but only to one run by the current user: the
+// default socket lives in a predictable directory under /tmp without a
+// runtime directory, which anyone could have created first.
+static AutoCloseFD connectAgent()
+{
+    auto socketPath = agentSocketPath();
+    if (!getEnv("MINI_AGENIX_AGENT_SOCKET"))
+        try {
+            ensurePrivateDir(socketPath.parent_path());
+        } catch (Error & e) {
+            debug("not using mini-agenix-agent: %s", e.what());
+            return {};
+        }
+    auto path = socketPath.string();
+
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path))
+        return {};
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    AutoCloseFD fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!fd || connect(fd.get(), reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1)
+        return {};
+
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd.get(), SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || cred.uid != getuid()) {
+        debug("not using mini-agenix-agent: '%s' is not served by the current user", path);
+        return {};
+    }
+    return fd;
+}
+
+std::optional<FileKey> agentUnwrap(std::string_view header)
+{
+    auto fd = connectAgent();
+    if (!fd)
+        return std::nullopt;
+
+    AgentStatus status;
+    std::string reply;
+    try {
+        FdSink to(fd.get());
+        to << uint64_t(AgentOp::Unwrap) << header;
+        to.flush();
+
+        FdSource from(fd.get());
+        status = AgentStatus(readNum<uint64_t>(from));
+        reply = readString(from);
+    } catch (Error &) {
+        // An agent that went away mid-request is the same as no agent.
+        return std::nullopt;
+    }
+
+    // Whatever went wrong in the agent, the caller's own identities may
+    // still work.
+    switch (status) {
+    case AgentStatus::Ok:
+        if (reply.size() != FileKey().size()) {
+            debug("mini-agenix-agent returned a malformed file key");
+            return std::nullopt;
+        }
+        break;
+    case AgentStatus::NoIdentity:
+        return std::nullopt;
+    default:
+        debug("mini-agenix-agent: %s", reply);
+        return std::nullopt;
+    }
+
+    FileKey fileKey;
+    std::memcpy(fileKey.data(), reply.data(), fileKey.size());
+    OPENSSL_cleanse(reply.data(), reply.size());
+    return fileKey;
+}
+
+} // namespace mini_agenix
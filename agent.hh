@@ -0,0 +1,51 @@
+#pragma once
+
+#include "age.hh"
+
+#include <filesystem>
+
+// Client side of mini-agenix-agent, a per-user daemon that keeps unwrapped
+// identities and recently used file keys so that separate evaluator
+// processes do not each have to load keys, ask for passphrases or start
+// plugins.
+//
+// The agent listens on a Unix socket that only its owner can connect to
+// and speaks the Nix wire format: a request is an AgentOp followed by a
+// string, a reply is an AgentStatus followed by a string.
+
+namespace mini_agenix {
+
+enum struct AgentOp : uint64_t {
+    // Argument: the header of an age file, up to the end of the MAC line.
+    // Reply: the 16-byte file key.
+    Unwrap = 1,
+    // Argument: a complete age file. Reply: the plaintext.
+    Decrypt = 2,
+};
+
+enum struct AgentStatus : uint64_t {
+    Ok = 0,
+    // None of the agent's identities matches.
+    NoIdentity = 1,
+    // Reply: an error message.
+    Failed = 2,
+};
+
+// $XDG_RUNTIME_DIR/mini-agenix, or /tmp/mini-agenix-<uid> without a
+// runtime directory. Holds the agent socket and other per-user state.
+std::filesystem::path userRuntimeDir();
+
+// Create a directory if it does not exist, and check that it belongs to
+// the current user and is not accessible to anyone else.
+void ensurePrivateDir(const std::filesystem::path & dir);
+
+// $MINI_AGENIX_AGENT_SOCKET, or agent.sock in userRuntimeDir().
+std::filesystem::path agentSocketPath();
+
+// Ask a running agent to unwrap the file key of a header. Returns
+// std::nullopt if no agent of the current user is running, or it has no
+// matching identity or fails to unwrap one. The caller still checks the
+// header MAC with the returned key.
+std::optional<FileKey> agentUnwrap(std::string_view header);
+
+} // namespace mini_agenix
@@ -0,0 +1,148 @@
+#include "arena.hh"
+
+#include <openssl/crypto.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace mini_agenix {
+
+// Buffers are rounded up to a power of two of at least a page. Released
+// buffers of up to maxPooledBuffer bytes are kept for reuse, as long as
+// the free ones add up to no more than maxPooled bytes; the rest are
+// unmapped.
+static constexpr size_t maxPooledBuffer = 16 << 20;
+static constexpr size_t maxPooled = 64 << 20;
+
+struct Pool
+{
+    std::mutex mutex;
+    // Free buffers, by log2 of their capacity.
+    std::array<std::vector<char *>, 64> free;
+    size_t pooled = 0;
+};
+
+static Pool & pool()
+{
+    // Never destroyed, as buffers may be released by other static
+    // destructors.
+    static auto pool = new Pool;
+    return *pool;
+}
+
+static size_t capacityFor(size_t size)
+{
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+    return std::bit_ceil(std::max(size, pageSize));
+}
+
+static char * mapBuffer(size_t capacity)
+{
+    auto p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::bad_alloc();
+    // Both are best effort: a buffer that cannot be locked, because of
+    // RLIMIT_MEMLOCK, is still usable.
+    madvise(p, capacity, MADV_DONTDUMP);
+    mlock(p, capacity);
+    return static_cast<char *>(p);
+}
+
+static char * acquire(size_t capacity)
+{
+    auto & pool_ = pool();
+    {
+        std::lock_guard lock(pool_.mutex);
+        if (auto & free = pool_.free[std::countr_zero(capacity)]; !free.empty()) {
+            auto p = free.back();
+            free.pop_back();
+            pool_.pooled -= capacity;
+            return p;
+        }
+    }
+    return mapBuffer(capacity);
+}
+
+// Only the first `used` bytes can have been written to since the buffer
+// was last wiped.
+static void release(char * p, size_t used, size_t capacity)
+{
+    OPENSSL_cleanse(p, used);
+    if (capacity <= maxPooledBuffer) {
+        auto & pool_ = pool();
+        std::lock_guard lock(pool_.mutex);
+        if (pool_.pooled + capacity <= maxPooled) {
+            pool_.free[std::countr_zero(capacity)].push_back(p);
+            pool_.pooled += capacity;
+            return;
+        }
+    }
+    munmap(p, capacity);
+}
+
+SecretBuffer::SecretBuffer(size_t size)
+    : size_(size)
+{
+    if (size) {
+        capacity_ = capacityFor(size);
+        data_ = acquire(capacity_);
+    }
+}
+
+SecretBuffer::SecretBuffer(std::string_view contents)
+    : SecretBuffer(contents.size())
+{
+    if (size_)
+        std::memcpy(data_, contents.data(), size_);
+}
+
+SecretBuffer::SecretBuffer(SecretBuffer && other) noexcept
+    : data_(std::exchange(other.data_, nullptr))
+    , size_(std::exchange(other.size_, 0))
+    , capacity_(std::exchange(other.capacity_, 0))
+{
+}
+
+SecretBuffer & SecretBuffer::operator=(SecretBuffer && other) noexcept
+{
+    if (this != &other) {
+        if (data_)
+            release(data_, size_, capacity_);
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+        capacity_ = std::exchange(other.capacity_, 0);
+    }
+    return *this;
+}
+
+SecretBuffer::~SecretBuffer()
+{
+    if (data_)
+        release(data_, size_, capacity_);
+}
+
+void SecretBuffer::append(std::string_view data)
+{
+    if (data.empty())
+        return;
+    if (size_ + data.size() > capacity_) {
+        SecretBuffer grown(size_ + data.size());
+        if (size_)
+            std::memcpy(grown.data_, data_, size_);
+        grown.size_ = size_;
+        *this = std::move(grown);
+    }
+    std::memcpy(data_ + size_, data.data(), data.size());
+    size_ += data.size();
+}
+
+} // namespace mini_agenix
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+// Buffers for decrypted plaintext. They come from a process-wide pool of
+// anonymous mappings that are faulted in when created, locked into RAM
+// where RLIMIT_MEMLOCK allows it, and excluded from core dumps. A buffer
+// is wiped when it is released and then reused, so decrypting many
+// secrets does not keep asking the allocator and the kernel for fresh
+// pages, and plaintext never reaches swap or a core file.
+
+namespace mini_agenix {
+
+class SecretBuffer
+{
+    char * data_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+
+public:
+    SecretBuffer() = default;
+
+    // A buffer of `size` bytes, with unspecified contents.
+    explicit SecretBuffer(size_t size);
+
+    // A copy of `contents`.
+    explicit SecretBuffer(std::string_view contents);
+
+    SecretBuffer(SecretBuffer && other) noexcept;
+    SecretBuffer & operator=(SecretBuffer && other) noexcept;
+    SecretBuffer(const SecretBuffer &) = delete;
+    SecretBuffer & operator=(const SecretBuffer &) = delete;
+
+    ~SecretBuffer();
+
+    char * data()
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    std::string_view view() const
+    {
+        return {data_, size_};
+    }
+
+    // Grows the buffer, moving it to a larger one from the pool if needed.
+    void append(std::string_view data);
+};
+
+} // namespace mini_agenix
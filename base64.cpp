@@ -0,0 +1,279 @@
+#include "base64.hh"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#  include <immintrin.h>
+#elif defined(__aarch64__)
+#  include <arm_neon.h>
+#endif
+
+namespace mini_agenix {
+
+static constexpr char base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Character to 6-bit value, or 0xff for characters outside the alphabet.
+static constexpr auto base64Values = []() {
+    std::array<uint8_t, 256> table{};
+    table.fill(0xff);
+    for (uint8_t i = 0; i < 64; ++i)
+        table[uint8_t(base64Chars[i])] = i;
+    return table;
+}();
+
+// Encodes whole 3-byte groups and the padded tail from `i` on.
+static void encodeScalar(const unsigned char * in, size_t n, size_t i, char * out)
+{
+    for (; i + 3 <= n; i += 3, out += 4) {
+        uint32_t v = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+        out[0] = base64Chars[v >> 18];
+        out[1] = base64Chars[(v >> 12) & 63];
+        out[2] = base64Chars[(v >> 6) & 63];
+        out[3] = base64Chars[v & 63];
+    }
+    if (i < n) {
+        uint32_t v = in[i] << 16 | (i + 1 < n ? in[i + 1] << 8 : 0);
+        out[0] = base64Chars[v >> 18];
+        out[1] = base64Chars[(v >> 12) & 63];
+        out[2] = i + 1 < n ? base64Chars[(v >> 6) & 63] : '=';
+        out[3] = '=';
+    }
+}
+
+#if defined(__x86_64__)
+
+// Wojciech Muła's and Daniel Lemire's AVX2 encoder: each block turns 24
+// input bytes into 32 characters. The load starts 4 bytes before the
+// group so that each 128-bit lane holds the 12 bytes it encodes.
+__attribute__((target("avx2"))) static inline __m256i encodeBlockAVX2(__m256i block)
+{
+    // Split each 3-byte group into four 6-bit indices, one per byte.
+    auto v = _mm256_shuffle_epi8(
+        block,
+        _mm256_set_epi8(
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1, 14, 15, 13, 14, 11, 12, 10, 11, 8, 9, 7, 8, 5, 6, 4, 5));
+    auto hi = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+    auto lo = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+    auto indices = _mm256_or_si256(hi, lo);
+
+    // Map 0-25, 26-51, 52-61, 62 and 63 to their characters by adding a
+    // per-range offset.
+    auto range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    range = _mm256_sub_epi8(range, _mm256_cmpgt_epi8(indices, _mm256_set1_epi8(25)));
+    auto offsets = _mm256_setr_epi8(
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    return _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, range));
+}
+
+// Returns the number of input bytes encoded, a multiple of 3.
+__attribute__((target("avx2"))) static size_t encodeAVX2(const unsigned char * in, size_t n, char * out)
+{
+    if (n < 28)
+        return 0;
+
+    // The first group has no 4 bytes before it to load.
+    unsigned char first[32] = {};
+    std::memcpy(first + 4, in, 28);
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(out),
+        encodeBlockAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(first))));
+
+    size_t i = 24;
+    for (out += 32; i + 28 <= n; i += 24, out += 32)
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i *>(out),
+            encodeBlockAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i - 4))));
+    return i;
+}
+
+#elif defined(__aarch64__)
+
+// 48 input bytes to 64 characters per iteration: vld3q deinterleaves the
+// bytes of each 3-byte group, and a 64-entry table lookup does the
+// mapping. Returns the number of input bytes encoded.
+static size_t encodeNEON(const unsigned char * in, size_t n, char * out)
+{
+    auto table = vld1q_u8_x4(reinterpret_cast<const uint8_t *>(base64Chars));
+    size_t i = 0;
+    for (; i + 48 <= n; i += 48, out += 64) {
+        auto src = vld3q_u8(in + i);
+        uint8x16x4_t dst;
+        dst.val[0] = vshrq_n_u8(src.val[0], 2);
+        dst.val[1] = vorrq_u8(vshrq_n_u8(src.val[1], 4), vandq_u8(vshlq_n_u8(src.val[0], 4), vdupq_n_u8(0x30)));
+        dst.val[2] = vorrq_u8(vshrq_n_u8(src.val[2], 6), vandq_u8(vshlq_n_u8(src.val[1], 2), vdupq_n_u8(0x3c)));
+        dst.val[3] = vandq_u8(src.val[2], vdupq_n_u8(0x3f));
+        for (auto & v : dst.val)
+            v = vqtbl4q_u8(table, v);
+        vst4q_u8(reinterpret_cast<uint8_t *>(out), dst);
+    }
+    return i;
+}
+
+#endif
+
+void base64EncodeInto(std::string_view s, char * out)
+{
+    auto in = reinterpret_cast<const unsigned char *>(s.data());
+    size_t done = 0;
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2)
+        done = encodeAVX2(in, s.size(), out);
+#elif defined(__aarch64__)
+    done = encodeNEON(in, s.size(), out);
+#endif
+    encodeScalar(in, s.size(), done, out + done / 3 * 4);
+}
+
+// Decodes the groups of 4 characters from `i` on; only the last one may
+// be padded.
+static std::optional<size_t> decodeScalar(const unsigned char * in, size_t n, size_t i, char * out)
+{
+    auto start = out;
+    for (; i < n; i += 4) {
+        auto a = base64Values[in[i]], b = base64Values[in[i + 1]];
+        auto c = base64Values[in[i + 2]], d = base64Values[in[i + 3]];
+        if ((a | b | c | d) < 64) {
+            uint32_t v = a << 18 | b << 12 | c << 6 | d;
+            *out++ = char(v >> 16);
+            *out++ = char(v >> 8);
+            *out++ = char(v);
+            continue;
+        }
+
+        // Padding: "xx==" or "xxx=", with the unused bits zero.
+        if (i + 4 != n || (a | b) >= 64 || in[i + 3] != '=')
+            return std::nullopt;
+        if (in[i + 2] == '=') {
+            if (b & 0x0f)
+                return std::nullopt;
+            *out++ = char(a << 2 | b >> 4);
+        } else {
+            if (c >= 64 || (c & 0x03))
+                return std::nullopt;
+            *out++ = char(a << 2 | b >> 4);
+            *out++ = char(b << 4 | c >> 2);
+        }
+    }
+    return out - start;
+}
+
+#if defined(__x86_64__)
+
+// Muła's AVX2 decoder: 32 characters to 24 bytes. A character is valid if
+// its high nibble is in the set allowed for its low nibble; both lookups
+// are pshufbs. Returns false if any character is invalid, including '='.
+__attribute__((target("avx2"))) static inline bool decodeBlockAVX2(const unsigned char * in, char * out)
+{
+    auto input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in));
+    auto hiNibbles = _mm256_and_si256(_mm256_srli_epi32(input, 4), _mm256_set1_epi8(0x0f));
+    auto loNibbles = _mm256_and_si256(input, _mm256_set1_epi8(0x0f));
+
+    auto allowed = _mm256_shuffle_epi8(
+        _mm256_setr_epi8(
+            char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+            char(0xf8), char(0xf8), char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54,
+            char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+            char(0xf8), char(0xf8), char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54),
+        loNibbles);
+    auto bit = _mm256_shuffle_epi8(
+        _mm256_setr_epi8(
+            0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0,
+            0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0),
+        hiNibbles);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(allowed, bit), _mm256_setzero_si256())))
+        return false;
+
+    // Per high nibble offsets to the 6-bit values; '/' shares its high
+    // nibble with '+' and needs its own.
+    auto shift = _mm256_shuffle_epi8(
+        _mm256_setr_epi8(
+            0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0),
+        hiNibbles);
+    shift = _mm256_blendv_epi8(shift, _mm256_set1_epi8(16), _mm256_cmpeq_epi8(input, _mm256_set1_epi8(0x2f)));
+    auto values = _mm256_add_epi8(input, shift);
+
+    // Pack four 6-bit values into 3 bytes per 32-bit lane, then move the
+    // 24 bytes together.
+    auto merged = _mm256_madd_epi16(
+        _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+    merged = _mm256_shuffle_epi8(
+        merged,
+        _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 0, 0));
+    _mm256_maskstore_epi32(
+        reinterpret_cast<int *>(out), _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0), merged);
+    return true;
+}
+
+// Returns the number of characters decoded, a multiple of 32. Stops at the
+// first block that is not plain base64, which leaves padding and errors
+// to decodeScalar.
+__attribute__((target("avx2"))) static size_t decodeAVX2(const unsigned char * in, size_t n, char * out)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32, out += 24)
+        if (!decodeBlockAVX2(in + i, out))
+            break;
+    return i;
+}
+
+#elif defined(__aarch64__)
+
+// 64 characters to 48 bytes per iteration: vld4q deinterleaves the
+// characters of each group, two 64-entry table lookups map them to
+// values (0xff if invalid), and vst3q interleaves the bytes.
+static size_t decodeNEON(const unsigned char * in, size_t n, char * out)
+{
+    auto lower = vld1q_u8_x4(base64Values.data());
+    auto upper = vld1q_u8_x4(base64Values.data() + 64);
+    auto translate = [&](uint8x16_t c) {
+        auto v = vqtbx4q_u8(vqtbl4q_u8(lower, c), upper, vsubq_u8(c, vdupq_n_u8(64)));
+        return vorrq_u8(v, vcgeq_u8(c, vdupq_n_u8(128)));
+    };
+
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64, out += 48) {
+        auto src = vld4q_u8(in + i);
+        for (auto & v : src.val)
+            v = translate(v);
+        auto any = vorrq_u8(vorrq_u8(src.val[0], src.val[1]), vorrq_u8(src.val[2], src.val[3]));
+        if (vmaxvq_u8(any) >= 64)
+            break;
+        uint8x16x3_t dst;
+        dst.val[0] = vorrq_u8(vshlq_n_u8(src.val[0], 2), vshrq_n_u8(src.val[1], 4));
+        dst.val[1] = vorrq_u8(vshlq_n_u8(src.val[1], 4), vshrq_n_u8(src.val[2], 2));
+        dst.val[2] = vorrq_u8(vshlq_n_u8(src.val[2], 6), src.val[3]);
+        vst3q_u8(reinterpret_cast<uint8_t *>(out), dst);
+    }
+    return i;
+}
+
+#endif
+
+std::optional<size_t> base64DecodeInto(std::string_view s, char * out)
+{
+    if (s.size() % 4)
+        return std::nullopt;
+    auto in = reinterpret_cast<const unsigned char *>(s.data());
+    size_t done = 0;
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2)
+        done = decodeAVX2(in, s.size(), out);
+#elif defined(__aarch64__)
+    done = decodeNEON(in, s.size(), out);
+#endif
+    auto rest = decodeScalar(in, s.size(), done, out + done / 4 * 3);
+    if (!rest)
+        return std::nullopt;
+    return done / 4 * 3 + *rest;
+}
+
+} // namespace mini_agenix
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string_view>
+
+// Standard (RFC 4648, padded) base64, vectorised with AVX2 on x86-64 when
+// the CPU has it and with NEON on AArch64, for secrets large enough for
+// the conversion to matter.
+
+namespace mini_agenix {
+
+constexpr size_t base64EncodedSize(size_t n)
+{
+    return (n + 2) / 3 * 4;
+}
+
+// Encode `in` into `out`, which must have room for
+// base64EncodedSize(in.size()) bytes.
+void base64EncodeInto(std::string_view in, char * out);
+
+// Decode `in`, whose length must be a multiple of 4, into `out`, which
+// must have room for in.size() / 4 * 3 bytes. Returns the number of
+// bytes written, or std::nullopt if `in` contains characters outside the
+// alphabet (including line breaks) or padding that is misplaced or not
+// canonical.
+std::optional<size_t> base64DecodeInto(std::string_view in, char * out);
+
+} // namespace mini_agenix
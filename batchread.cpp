@@ -0,0 +1,366 @@
+#include "batchread.hh"
+
+#include <nix/util/environment-variables.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/logging.hh>
+#include <nix/util/strings.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace mini_agenix {
+
+using namespace nix;
+
+unsigned ioDepth()
+{
+    if (auto depth = getEnv("MINI_AGENIX_IO_DEPTH"))
+        if (auto n = string2Int<unsigned>(*depth); n && *n > 0)
+            return *n;
+    return 128;
+}
+
+// Bounds the ring size, which the kernel limits, and the threads of the
+// fallback.
+static constexpr unsigned maxDepth = 4096;
+static constexpr unsigned maxThreads = 64;
+
+// Just enough of io_uring, set up with raw system calls so that liburing
+// is not needed.
+class Ring
+{
+    int fd = -1;
+    io_uring_params params{};
+    void * sqRing = MAP_FAILED;
+    void * cqRing = MAP_FAILED;
+    void * sqes = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+    unsigned sqTail = 0;
+    unsigned toSubmit = 0;
+
+    static unsigned & field(void * ring, unsigned offset)
+    {
+        return *reinterpret_cast<unsigned *>(static_cast<char *>(ring) + offset);
+    }
+
+public:
+    Ring() = default;
+    Ring(const Ring &) = delete;
+    Ring & operator=(const Ring &) = delete;
+
+    ~Ring()
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Returns false if io_uring, or a feature needed here, is unavailable.
+    bool setup(unsigned entries)
+    {
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0)
+            return false;
+        // Opening and statting files through the ring needs Linux 5.6,
+        // the first version to report this feature.
+        if (!(params.features & IORING_FEAT_RW_CUR_POS))
+            return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        auto single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+        cqRing = single ? sqRing
+                        : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+            return false;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+
+        sqTail = field(sqRing, params.sq_off.tail);
+        return true;
+    }
+
+    // A cleared submission queue entry. At most as many as the ring has
+    // entries may be taken between calls to submitAndWait.
+    io_uring_sqe & next()
+    {
+        auto index = sqTail & field(sqRing, params.sq_off.ring_mask);
+        (&field(sqRing, params.sq_off.array))[index] = index;
+        auto & sqe = static_cast<io_uring_sqe *>(sqes)[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        ++sqTail;
+        ++toSubmit;
+        return sqe;
+    }
+
+    // Submits the entries taken so far and waits for a completion.
+    void submitAndWait()
+    {
+        std::atomic_ref(field(sqRing, params.sq_off.tail)).store(sqTail, std::memory_order_release);
+        while (true) {
+            auto n = syscall(__NR_io_uring_enter, fd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (n >= 0) {
+                toSubmit -= n;
+                return;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                throw SysError("waiting for io_uring completions");
+        }
+    }
+
+    // Waits for a completion without submitting anything. Returns false
+    // if the ring cannot be entered.
+    bool wait()
+    {
+        while (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0)
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                return false;
+        return true;
+    }
+
+    // Entries taken but not yet submitted to the kernel.
+    unsigned unsubmitted() const
+    {
+        return toSubmit;
+    }
+
+    template<typename F>
+    void reap(F && f)
+    {
+        auto & head = field(cqRing, params.cq_off.head);
+        auto tail = std::atomic_ref(field(cqRing, params.cq_off.tail)).load(std::memory_order_acquire);
+        auto mask = field(cqRing, params.cq_off.ring_mask);
+        auto cqes = reinterpret_cast<io_uring_cqe *>(static_cast<char *>(cqRing) + params.cq_off.cqes);
+        for (auto i = head; i != tail; ++i) {
+            auto cqe = cqes[i & mask];
+            std::atomic_ref(head).store(i + 1, std::memory_order_release);
+            f(cqe);
+        }
+    }
+};
+
+// A file being read through the ring. It is opened and statted at once;
+// once both have completed, it is read at the size statx reported.
+struct InFlight
+{
+    enum Op : uint64_t { Open, Stat, Read };
+
+    size_t file;
+    int fd = -1;
+    int error = 0;
+    unsigned outstanding = 0;
+    bool reading = false;
+    // Files that report no size, as in /proc, are read until EOF.
+    bool unsized = false;
+    struct statx stx;
+    std::string data;
+    size_t done = 0;
+};
+
+static void readWithRing(
+    Ring & ring, const std::vector<std::filesystem::path> & paths, std::vector<std::optional<std::string>> & results, unsigned depth)
+{
+    std::vector<InFlight> slots(depth);
+    size_t nextFile = 0, finished = 0;
+
+    auto userData = [](size_t slot, InFlight::Op op) { return uint64_t(slot) << 2 | op; };
+
+    auto submitRead = [&](size_t s) {
+        auto & slot = slots[s];
+        auto & sqe = ring.next();
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = slot.fd;
+        sqe.addr = reinterpret_cast<uint64_t>(slot.data.data() + slot.done);
+        sqe.len = std::min<size_t>(slot.data.size() - slot.done, 1u << 30);
+        sqe.off = slot.done;
+        sqe.user_data = userData(s, InFlight::Read);
+        ++slot.outstanding;
+    };
+
+    auto start = [&](size_t s) {
+        if (nextFile == paths.size())
+            return;
+        auto & slot = slots[s] = InFlight{.file = nextFile++};
+        auto path = reinterpret_cast<uint64_t>(paths[slot.file].c_str());
+
+        auto & open = ring.next();
+        open.opcode = IORING_OP_OPENAT;
+        open.fd = AT_FDCWD;
+        open.addr = path;
+        open.open_flags = O_RDONLY | O_CLOEXEC;
+        open.user_data = userData(s, InFlight::Open);
+
+        auto & stat = ring.next();
+        stat.opcode = IORING_OP_STATX;
+        stat.fd = AT_FDCWD;
+        stat.addr = path;
+        stat.len = STATX_TYPE | STATX_SIZE;
+        stat.off = reinterpret_cast<uint64_t>(&slot.stx);
+        stat.user_data = userData(s, InFlight::Stat);
+
+        slot.outstanding = 2;
+    };
+
+    auto finish = [&](size_t s) {
+        auto & slot = slots[s];
+        if (slot.fd >= 0)
+            close(slot.fd);
+        slot.fd = -1;
+        if (!slot.error)
+            results[slot.file] = std::move(slot.data);
+        ++finished;
+        start(s);
+    };
+
+    for (size_t s = 0; s < slots.size(); ++s)
+        start(s);
+
+    // io_uring_enter can fail at any time, e.g. with ENOMEM or when a
+    // seccomp filter denies it. The kernel may still write to the slots
+    // of what it has taken from the ring, so wait for that before they go,
+    // or keep them for good if the ring cannot even be waited on.
+    auto abandon = [&]() {
+        size_t inKernel = 0;
+        for (auto & slot : slots)
+            inKernel += slot.outstanding;
+        inKernel -= ring.unsubmitted();
+        while (inKernel > 0 && ring.wait())
+            ring.reap([&](const io_uring_cqe & cqe) {
+                --inKernel;
+                auto & slot = slots[cqe.user_data >> 2];
+                if ((cqe.user_data & 3) == InFlight::Open && cqe.res >= 0)
+                    slot.fd = cqe.res;
+            });
+        for (auto & slot : slots)
+            if (slot.fd >= 0)
+                close(slot.fd);
+        if (inKernel > 0)
+            new std::vector<InFlight>(std::move(slots));
+    };
+
+    while (finished < paths.size()) {
+        try {
+            ring.submitAndWait();
+        } catch (SysError &) {
+            abandon();
+            throw;
+        }
+        ring.reap([&](const io_uring_cqe & cqe) {
+            auto s = cqe.user_data >> 2;
+            auto & slot = slots[s];
+            --slot.outstanding;
+
+            switch (cqe.user_data & 3) {
+            case InFlight::Open:
+                if (cqe.res < 0)
+                    slot.error = -cqe.res;
+                else
+                    slot.fd = cqe.res;
+                break;
+            case InFlight::Stat:
+                if (cqe.res < 0)
+                    slot.error = -cqe.res;
+                else if (!S_ISREG(slot.stx.stx_mode))
+                    slot.error = EINVAL;
+                break;
+            case InFlight::Read:
+                if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+                    submitRead(s);
+                else if (cqe.res < 0)
+                    slot.error = -cqe.res;
+                else if (cqe.res == 0)
+                    slot.data.resize(slot.done);
+                else {
+                    slot.done += cqe.res;
+                    if (slot.done == slot.data.size() && slot.unsized)
+                        slot.data.resize(slot.data.size() * 2);
+                    if (slot.done < slot.data.size())
+                        submitRead(s);
+                }
+                break;
+            }
+
+            if (slot.outstanding)
+                return;
+            if (!slot.error && !slot.reading) {
+                slot.reading = true;
+                slot.unsized = slot.stx.stx_size == 0;
+                slot.data.resize(slot.unsized ? 4096 : slot.stx.stx_size);
+                submitRead(s);
+                return;
+            }
+            finish(s);
+        });
+    }
+}
+
+// Reads the files that have no result yet.
+static void readWithThreads(
+    const std::vector<std::filesystem::path> & paths, std::vector<std::optional<std::string>> & results, unsigned depth)
+{
+    std::vector<size_t> unread;
+    for (size_t i = 0; i < paths.size(); ++i)
+        if (!results[i])
+            unread.push_back(i);
+
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+        for (size_t j; (j = next++) < unread.size();)
+            try {
+                results[unread[j]] = readFile(paths[unread[j]].string());
+            } catch (Error &) {
+            }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min<size_t>(depth, std::min<size_t>(maxThreads, unread.size())); ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto & thread : threads)
+        thread.join();
+}
+
+std::vector<std::optional<std::string>> readFiles(const std::vector<std::filesystem::path> & paths, unsigned depth)
+{
+    std::vector<std::optional<std::string>> results(paths.size());
+    if (paths.empty())
+        return results;
+
+    depth = std::clamp<size_t>(std::min<size_t>(depth, paths.size()), 1, maxDepth);
+    Ring ring;
+    if (ring.setup(std::bit_ceil(2 * depth)))
+        try {
+            readWithRing(ring, paths, results, depth);
+            return results;
+        } catch (SysError & e) {
+            debug("reading the rest of the files without io_uring: %s", e.what());
+        }
+    readWithThreads(paths, results, depth);
+    return results;
+}
+
+} // namespace mini_agenix
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Reads many files at once. With io_uring, up to `depth` files are in
+// flight at a time, each opened, sized and read through the ring without
+// a thread per file, so cold caches and network file systems cost one
+// round trip per file rather than several in a row. Without io_uring
+// (old kernels, or seccomp filters that block it), or if the ring fails
+// partway, a pool of up to `depth` threads does blocking reads of the
+// files not read yet instead.
+
+namespace mini_agenix {
+
+// $MINI_AGENIX_IO_DEPTH, or 128.
+unsigned ioDepth();
+
+// The contents of each file, or std::nullopt if it could not be read.
+std::vector<std::optional<std::string>> readFiles(const std::vector<std::filesystem::path> & paths, unsigned depth);
+
+} // namespace mini_agenix
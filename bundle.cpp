@@ -0,0 +1,113 @@
+#include "bundle.hh"
+
+#include <nix/util/hash.hh>
+
+#include <charconv>
+#include <cstring>
+#include <optional>
+#include <vector>
+
+namespace mini_agenix {
+
+using namespace nix;
+
+static constexpr std::string_view bundleMagic = "mini-agenix-bundle/v1 ";
+static constexpr size_t numberWidth = 20;
+static constexpr size_t sha256Width = 64;
+static constexpr size_t headerSize = bundleMagic.size() + numberWidth + 1;
+
+static std::string fixedWidth(uint64_t n)
+{
+    auto s = std::to_string(n);
+    return std::string(numberWidth - s.size(), '0') + s;
+}
+
+static std::optional<uint64_t> parseFixedWidth(std::string_view s)
+{
+    uint64_t n;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+    if (s.size() != numberWidth || ec != std::errc() || end != s.data() + s.size())
+        return std::nullopt;
+    return n;
+}
+
+std::string packBundle(const std::map<std::string, std::string> & entries)
+{
+    uint64_t indexSize = 0;
+    for (auto & [name, content] : entries) {
+        if (name.empty() || name.find_first_of(std::string_view("\n\0", 2)) != std::string::npos)
+            throw BundleError("invalid bundle entry name '%s'", name);
+        indexSize += 2 * numberWidth + sha256Width + name.size() + 4;
+    }
+
+    std::string index;
+    index.reserve(indexSize);
+    auto offset = headerSize + indexSize;
+    std::vector<uint64_t> offsets;
+    for (auto & [name, content] : entries) {
+        auto used = offset % bundleChunkSize;
+        if (used != 0 && (content.size() > bundleChunkSize || used + content.size() > bundleChunkSize))
+            offset += bundleChunkSize - used;
+        offsets.push_back(offset);
+        index += fixedWidth(offset) + " " + fixedWidth(content.size()) + " "
+                 + hashString(HashAlgorithm::SHA256, content).to_string(HashFormat::Base16, false) + " " + name
+                 + "\n";
+        offset += content.size();
+    }
+
+    std::string bundle(offset, '\0');
+    auto header = std::string(bundleMagic) + fixedWidth(indexSize) + "\n";
+    std::memcpy(bundle.data(), header.data(), header.size());
+    std::memcpy(bundle.data() + headerSize, index.data(), index.size());
+    size_t i = 0;
+    for (auto & [name, content] : entries)
+        std::memcpy(bundle.data() + offsets[i++], content.data(), content.size());
+    return bundle;
+}
+
+BundleIndex readBundleIndex(uint64_t size, const std::function<std::string(uint64_t, uint64_t)> & read)
+{
+    if (size < headerSize)
+        throw BundleError("not a mini-agenix bundle");
+
+    // The header and a small index are in the first chunk, which is only
+    // decrypted once.
+    auto prefix = read(0, std::min(size, bundleChunkSize));
+    auto indexSize = parseFixedWidth(std::string_view(prefix).substr(bundleMagic.size(), numberWidth));
+    if (!prefix.starts_with(bundleMagic) || !indexSize || prefix[headerSize - 1] != '\n')
+        throw BundleError("not a mini-agenix bundle");
+    if (*indexSize > size - headerSize)
+        throw BundleError("bundle index is truncated");
+
+    BundleIndex result;
+    result.text = headerSize + *indexSize <= prefix.size() ? prefix.substr(headerSize, *indexSize)
+                                                           : read(headerSize, *indexSize);
+
+    std::string_view rest = result.text;
+    while (!rest.empty()) {
+        auto eol = rest.find('\n');
+        if (eol == std::string_view::npos)
+            throw BundleError("bundle index is not terminated by a newline");
+        auto line = rest.substr(0, eol);
+        rest.remove_prefix(eol + 1);
+
+        constexpr auto nameStart = 2 * numberWidth + sha256Width + 3;
+        if (line.size() <= nameStart || line[numberWidth] != ' ' || line[2 * numberWidth + 1] != ' '
+            || line[nameStart - 1] != ' ')
+            throw BundleError("malformed bundle index line '%s'", line);
+        auto offset = parseFixedWidth(line.substr(0, numberWidth));
+        auto length = parseFixedWidth(line.substr(numberWidth + 1, numberWidth));
+        auto sha256 = line.substr(2 * numberWidth + 2, sha256Width);
+        auto name = std::string(line.substr(nameStart));
+        if (!offset || !length || sha256.find_first_not_of("0123456789abcdef") != std::string_view::npos)
+            throw BundleError("malformed bundle index line '%s'", line);
+        if (*offset < headerSize + *indexSize || *offset > size || *length > size - *offset)
+            throw BundleError("bundle entry '%s' is outside the bundle", name);
+        if (!result.entries.emplace(name, BundleEntry{*offset, *length, std::string(sha256)}).second)
+            throw BundleError("duplicate bundle entry '%s'", name);
+    }
+
+    return result;
+}
+
+} // namespace mini_agenix
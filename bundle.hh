@@ -0,0 +1,61 @@
+#pragma once
+
+#include <nix/util/error.hh>
+
+#include <functional>
+#include <map>
+#include <string>
+
+// Bundles: many secrets in one age file, so that they share one header,
+// one file key unwrap and one ciphertext read.
+//
+// The plaintext of a bundle is
+//
+//   mini-agenix-bundle/v1 <index size, 20 digits>\n
+//   <index>
+//   <entry data>
+//
+// where the index has one line per entry, sorted by name:
+//
+//   <offset, 20 digits> <length, 20 digits> <SHA-256, base16> <name>\n
+//
+// Offsets are from the start of the plaintext. An entry that fits in one
+// STREAM chunk never straddles two, and larger entries start on a chunk
+// boundary, so reading an entry decrypts as few chunks as possible. The
+// gaps are zero-filled.
+
+namespace mini_agenix {
+
+using nix::Error;
+
+MakeError(BundleError, Error);
+
+// The plaintext size of age's STREAM chunks.
+constexpr uint64_t bundleChunkSize = 64 * 1024;
+
+struct BundleEntry
+{
+    uint64_t offset;
+    uint64_t length;
+    // SHA-256 of the entry, in base16.
+    std::string sha256;
+};
+
+struct BundleIndex
+{
+    std::map<std::string, BundleEntry> entries;
+    // The index as stored in the bundle, which pins every entry's hash.
+    std::string text;
+};
+
+// Lay out the plaintext of a bundle with the given entries. Throws
+// BundleError on names that cannot be stored (empty, or containing a
+// newline or NUL).
+std::string packBundle(const std::map<std::string, std::string> & entries);
+
+// Read the index of a bundle whose plaintext is `size` bytes long, using
+// `read(offset, length)` to get plaintext ranges. Throws BundleError if
+// the index is malformed or points outside the plaintext.
+BundleIndex readBundleIndex(uint64_t size, const std::function<std::string(uint64_t, uint64_t)> & read);
+
+} // namespace mini_agenix
@@ -0,0 +1,241 @@
+#include "cbor.hh"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_set>
+
+namespace mini_agenix {
+
+using namespace nix;
+
+namespace {
+
+// Nesting deeper than this is rejected rather than risking the stack.
+constexpr unsigned maxDepth = 512;
+
+struct CBORDecoder
+{
+    EvalState & state;
+    std::string_view data;
+    size_t pos = 0;
+
+    uint8_t byte()
+    {
+        if (pos >= data.size())
+            throw CBORError("CBOR data is truncated");
+        return data[pos++];
+    }
+
+    std::string_view take(uint64_t n)
+    {
+        if (n > data.size() - pos)
+            throw CBORError("CBOR data is truncated");
+        auto s = data.substr(pos, n);
+        pos += n;
+        return s;
+    }
+
+    uint64_t bigEndian(unsigned n)
+    {
+        uint64_t x = 0;
+        for (auto c : take(n))
+            x = (x << 8) | uint8_t(c);
+        return x;
+    }
+
+    // The argument of an initial byte: a length, count or integer value.
+    // Additional information 31 (indefinite length) is left to the caller.
+    uint64_t argument(uint8_t info)
+    {
+        if (info < 24)
+            return info;
+        switch (info) {
+        case 24:
+            return bigEndian(1);
+        case 25:
+            return bigEndian(2);
+        case 26:
+            return bigEndian(4);
+        case 27:
+            return bigEndian(8);
+        case 31:
+            return 0;
+        default:
+            throw CBORError("reserved CBOR additional information %d", unsigned(info));
+        }
+    }
+
+    bool atBreak()
+    {
+        if (pos < data.size() && uint8_t(data[pos]) == 0xff) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    // A definite or indefinite-length byte or text string.
+    std::string string(uint8_t major, uint8_t info)
+    {
+        if (info != 31)
+            return std::string(take(argument(info)));
+
+        std::string s;
+        while (!atBreak()) {
+            auto initial = byte();
+            if (initial >> 5 != major || (initial & 0x1f) == 31)
+                throw CBORError("malformed chunk in indefinite-length CBOR string");
+            s += take(argument(initial & 0x1f));
+        }
+        return s;
+    }
+
+    // Each element takes at least one byte, so larger counts are bogus
+    // and must not be used to size allocations.
+    void checkCount(uint64_t count)
+    {
+        if (count > data.size() - pos)
+            throw CBORError("CBOR data is truncated");
+    }
+
+    static double halfToDouble(uint16_t half)
+    {
+        int exponent = (half >> 10) & 0x1f;
+        int mantissa = half & 0x3ff;
+        double value = exponent == 0 ? std::ldexp(mantissa, -24)
+                       : exponent != 31 ? std::ldexp(mantissa + 1024, exponent - 25)
+                       : mantissa == 0  ? std::numeric_limits<double>::infinity()
+                                        : std::numeric_limits<double>::quiet_NaN();
+        return half & 0x8000 ? -value : value;
+    }
+
+    void value(Value & v, unsigned depth)
+    {
+        if (depth > maxDepth)
+            throw CBORError("CBOR data is nested too deeply");
+
+        auto initial = byte();
+        auto major = initial >> 5;
+        auto info = initial & 0x1f;
+
+        if (major == 7) {
+            switch (info) {
+            case 20:
+                v.mkBool(false);
+                return;
+            case 21:
+                v.mkBool(true);
+                return;
+            case 22:
+            case 23:
+                v.mkNull();
+                return;
+            case 25:
+                v.mkFloat(halfToDouble(bigEndian(2)));
+                return;
+            case 26: {
+                auto bits = uint32_t(bigEndian(4));
+                float f;
+                std::memcpy(&f, &bits, sizeof(f));
+                v.mkFloat(f);
+                return;
+            }
+            case 27: {
+                auto bits = bigEndian(8);
+                double d;
+                std::memcpy(&d, &bits, sizeof(d));
+                v.mkFloat(d);
+                return;
+            }
+            case 31:
+                throw CBORError("unexpected CBOR break");
+            default:
+                throw CBORError("unsupported CBOR simple value %d", unsigned(info));
+            }
+        }
+
+        if (major == 2 || major == 3) {
+            auto s = string(major, info);
+            if (s.find('\0') != std::string::npos)
+                throw CBORError("CBOR string contains a NUL byte, which Nix strings cannot hold");
+            v.mkString(s, state.mem);
+            return;
+        }
+
+        bool indefinite = info == 31;
+        if (indefinite && major != 4 && major != 5)
+            throw CBORError("invalid indefinite-length CBOR item");
+        auto arg = argument(info);
+
+        switch (major) {
+        case 0:
+            if (arg > uint64_t(std::numeric_limits<NixInt::Inner>::max()))
+                throw CBORError("CBOR integer %d does not fit in a Nix integer", arg);
+            v.mkInt(NixInt::Inner(arg));
+            break;
+
+        case 1:
+            if (arg > uint64_t(std::numeric_limits<NixInt::Inner>::max()))
+                throw CBORError("CBOR integer -1-%d does not fit in a Nix integer", arg);
+            v.mkInt(-1 - NixInt::Inner(arg));
+            break;
+
+        case 4: {
+            checkCount(arg);
+            // Traced, so that the GC sees the elements before they are in
+            // the list.
+            ValueVector elems;
+            elems.reserve(arg);
+            for (uint64_t i = 0; indefinite ? !atBreak() : i < arg; ++i) {
+                auto elem = state.allocValue();
+                value(*elem, depth + 1);
+                elems.push_back(elem);
+            }
+            auto list = state.buildList(elems.size());
+            for (size_t i = 0; i < elems.size(); ++i)
+                list[i] = elems[i];
+            v.mkList(list);
+            break;
+        }
+
+        case 5: {
+            checkCount(arg);
+            std::vector<std::pair<Symbol, Value *>, traceable_allocator<std::pair<Symbol, Value *>>> entries;
+            std::unordered_set<std::string> seen;
+            for (uint64_t i = 0; indefinite ? !atBreak() : i < arg; ++i) {
+                auto keyInitial = byte();
+                if (keyInitial >> 5 != 3)
+                    throw CBORError("CBOR map key is not a text string");
+                auto key = string(3, keyInitial & 0x1f);
+                if (!seen.insert(key).second)
+                    throw CBORError("duplicate CBOR map key '%s'", key);
+                auto elem = state.allocValue();
+                value(*elem, depth + 1);
+                entries.emplace_back(state.symbols.create(key), elem);
+            }
+            auto attrs = state.buildBindings(entries.size());
+            for (auto & [key, elem] : entries)
+                attrs.insert(key, elem);
+            v.mkAttrs(attrs);
+            break;
+        }
+
+        case 6:
+            value(v, depth + 1);
+            break;
+        }
+    }
+};
+
+} // namespace
+
+void parseCBOR(EvalState & state, std::string_view data, Value & v)
+{
+    CBORDecoder decoder{state, data};
+    decoder.value(v, 0);
+    if (decoder.pos != data.size())
+        throw CBORError("trailing data after CBOR item");
+}
+
+} // namespace mini_agenix
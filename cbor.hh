@@ -0,0 +1,21 @@
+#pragma once
+
+#include <nix/expr/eval.hh>
+
+#include <string_view>
+
+namespace mini_agenix {
+
+using nix::Error;
+
+MakeError(CBORError, Error);
+
+// Decode a single CBOR data item (RFC 8949) into a Nix value, the way
+// builtins.fromJSON would decode the equivalent JSON: maps with text keys
+// become attribute sets, arrays become lists, and so on. Tags are
+// ignored, undefined becomes null, and byte strings become strings if
+// they contain no NUL bytes. Throws CBORError on malformed input,
+// trailing data, or items that have no Nix equivalent.
+void parseCBOR(nix::EvalState & state, std::string_view data, nix::Value & v);
+
+} // namespace mini_agenix
@@ -0,0 +1,87 @@
+#include "keyring.hh"
+
+#include <nix/util/environment-variables.hh>
+#include <nix/util/logging.hh>
+#include <nix/util/strings.hh>
+
+#include <openssl/crypto.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace mini_agenix {
+
+using namespace nix;
+
+// Permission bits from keyutils.h, which is not part of the kernel
+// headers. Other processes of the same user may find and read the keys.
+static constexpr uint32_t keyPossessorAll = 0x3f000000;
+static constexpr uint32_t keyUserViewReadSearch = 0x00010000 | 0x00020000 | 0x00080000;
+
+static std::string keyDescription(std::string_view headerHash)
+{
+    return "mini-agenix:" + std::string(headerHash);
+}
+
+std::optional<KeyringSettings> keyringSettings()
+{
+    auto keyring = getEnv("MINI_AGENIX_KEYRING").value_or("");
+    KeyringSettings settings{.keyring = 0, .timeout = std::chrono::seconds(600)};
+    if (keyring == "user")
+        settings.keyring = KEY_SPEC_USER_KEYRING;
+    else if (keyring == "session")
+        settings.keyring = KEY_SPEC_SESSION_KEYRING;
+    else {
+        if (!keyring.empty())
+            warn("ignoring unknown MINI_AGENIX_KEYRING '%s' (expected 'user' or 'session')", keyring);
+        return std::nullopt;
+    }
+
+    if (auto timeout = getEnv("MINI_AGENIX_KEYRING_TIMEOUT")) {
+        if (auto n = string2Int<unsigned>(*timeout); n && *n > 0)
+            settings.timeout = std::chrono::seconds(*n);
+        else
+            warn("ignoring invalid MINI_AGENIX_KEYRING_TIMEOUT '%s'", *timeout);
+    }
+    return settings;
+}
+
+std::optional<FileKey> keyringLookup(const KeyringSettings & settings, std::string_view headerHash)
+{
+    auto description = keyDescription(headerHash);
+    auto key = syscall(SYS_keyctl, KEYCTL_SEARCH, settings.keyring, "user", description.c_str(), 0);
+    if (key == -1)
+        return std::nullopt;
+
+    FileKey fileKey;
+    auto n = syscall(SYS_keyctl, KEYCTL_READ, key, fileKey.data(), fileKey.size());
+    if (n != long(fileKey.size())) {
+        OPENSSL_cleanse(fileKey.data(), fileKey.size());
+        return std::nullopt;
+    }
+    return fileKey;
+}
+
+void keyringStore(const KeyringSettings & settings, std::string_view headerHash, const FileKey & fileKey)
+{
+    auto description = keyDescription(headerHash);
+    auto key = syscall(SYS_add_key, "user", description.c_str(), fileKey.data(), fileKey.size(), settings.keyring);
+    if (key == -1) {
+        debug("cannot add '%s' to the kernel keyring: %s", description, strerror(errno));
+        return;
+    }
+    // A file key must not stay in the keyring without its expiry or with
+    // the default permissions.
+    if (syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, key, unsigned(settings.timeout.count())) == -1
+        || syscall(SYS_keyctl, KEYCTL_SETPERM, key, keyPossessorAll | keyUserViewReadSearch) == -1) {
+        debug("cannot restrict '%s' in the kernel keyring: %s", description, strerror(errno));
+        if (syscall(SYS_keyctl, KEYCTL_INVALIDATE, key) == -1)
+            syscall(SYS_keyctl, KEYCTL_REVOKE, key);
+    }
+}
+
+} // namespace mini_agenix
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "age.hh"
+
+#include <chrono>
+
+// Caching of unwrapped file keys in the Linux kernel keyring, so that
+// separate evaluator processes can skip the unwrap of a header that was
+// seen before without running mini-agenix-agent. Keys live in kernel
+// memory only and expire on their own.
+
+namespace mini_agenix {
+
+struct KeyringSettings
+{
+    // KEY_SPEC_USER_KEYRING or KEY_SPEC_SESSION_KEYRING.
+    int keyring;
+    std::chrono::seconds timeout;
+};
+
+// From $MINI_AGENIX_KEYRING ("user" or "session") and
+// $MINI_AGENIX_KEYRING_TIMEOUT (seconds, default 600). Returns
+// std::nullopt if caching is disabled, which is the default.
+std::optional<KeyringSettings> keyringSettings();
+
+// Both take the hex SHA-256 of the header and ignore keyring errors: the
+// cache is an optimisation only.
+std::optional<FileKey> keyringLookup(const KeyringSettings & settings, std::string_view headerHash);
+
+void keyringStore(const KeyringSettings & settings, std::string_view headerHash, const FileKey & fileKey);
+
+} // namespace mini_agenix
@@ -0,0 +1,241 @@
+#include "manifest.hh"
+
+#include <nix/util/environment-variables.hh>
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/strings.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <ranges>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mini_agenix {
+
+using namespace nix;
+
+std::optional<std::filesystem::path> resolvedManifest()
+{
+    // Never destroyed, as prefetch threads left behind at exit may still
+    // load the manifest.
+    static auto manifest = new std::optional<std::filesystem::path>([]() -> std::optional<std::filesystem::path> {
+        auto env = getEnv("MINI_AGENIX_MANIFEST");
+        if (!env || env->empty())
+            return std::nullopt;
+        return std::filesystem::path(*env);
+    }());
+    return *manifest;
+}
+
+std::string fileFingerprint(const std::filesystem::path & file)
+{
+    struct stat st;
+    if (stat(file.c_str(), &st) == -1)
+        return "";
+    return std::to_string(st.st_ino) + ":" + std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec) + "."
+           + std::to_string(st.st_mtim.tv_nsec);
+}
+
+// One line per secret, its fields separated by tabs. The file comes last,
+// so it may contain tabs, but not line breaks.
+static std::string toLine(const ResolvedSecret & secret)
+{
+    return secret.hash + "\t" + secret.compression + "\t" + secret.storePath + "\t" + secret.fingerprint + "\t"
+           + std::to_string(secret.micros) + "\t" + secret.file + "\n";
+}
+
+static std::optional<ResolvedSecret> fromLine(std::string_view line)
+{
+    std::string_view fields[6];
+    for (size_t i = 0; i < 5; ++i) {
+        auto tab = line.find('\t');
+        if (tab == line.npos)
+            return std::nullopt;
+        fields[i] = line.substr(0, tab);
+        line.remove_prefix(tab + 1);
+    }
+    fields[5] = line;
+
+    auto micros = string2Int<uint64_t>(fields[4]);
+    if (!micros || fields[5].empty())
+        return std::nullopt;
+    return ResolvedSecret{
+        .file = std::string(fields[5]),
+        .compression = std::string(fields[1]),
+        .hash = std::string(fields[0]),
+        .storePath = std::string(fields[2]),
+        .fingerprint = std::string(fields[3]),
+        .micros = *micros,
+    };
+}
+
+// The latest entry per file and compression, if the file is unchanged.
+static std::vector<ResolvedSecret> latestEntries(std::string_view contents)
+{
+    std::map<std::pair<std::string, std::string>, ResolvedSecret> latest;
+    for (size_t start = 0, end; start < contents.size(); start = end + 1) {
+        end = contents.find('\n', start);
+        if (end == std::string::npos)
+            end = contents.size();
+        if (auto secret = fromLine(contents.substr(start, end - start)))
+            latest.insert_or_assign({secret->file, secret->compression}, std::move(*secret));
+    }
+
+    std::vector<ResolvedSecret> secrets;
+    for (auto & [key, secret] : latest)
+        if (fileFingerprint(secret.file) == secret.fingerprint)
+            secrets.push_back(std::move(secret));
+    return secrets;
+}
+
+// Appends lines to the manifest, or, once it would hold more than twice
+// the lines it needs, replaces it with only those. The writers of all
+// evaluations take the same lock, so no line is lost to a replacement;
+// readers see either manifest whole.
+static void writeLines(const std::filesystem::path & manifest, const std::string & lines)
+{
+    auto lockPath = manifest;
+    lockPath += ".lock";
+    AutoCloseFD lock = ::open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (!lock || flock(lock.get(), LOCK_EX) == -1)
+        return;
+
+    std::string contents;
+    try {
+        contents = readFile(manifest.string());
+    } catch (Error &) {
+    }
+    contents += lines;
+
+    std::string compacted;
+    for (auto & secret : latestEntries(contents))
+        compacted += toLine(secret);
+
+    auto writing = manifest;
+    std::string_view written = lines;
+    if (contents.size() > 2 * compacted.size()) {
+        writing += "." + std::to_string(getpid());
+        written = compacted;
+    }
+
+    AutoCloseFD fd = ::open(
+        writing.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (writing == manifest ? O_APPEND : O_TRUNC), 0600);
+    try {
+        if (!fd)
+            throw SysError("opening '%s'", writing.string());
+        writeFull(fd.get(), written);
+        fd.close();
+        if (writing != manifest)
+            std::filesystem::rename(writing, manifest);
+    } catch (std::exception &) {
+        if (writing != manifest) {
+            std::error_code ec;
+            std::filesystem::remove(writing, ec);
+        }
+    }
+}
+
+namespace {
+
+struct Node
+{
+    ResolvedSecret secret;
+    Node * next = nullptr;
+};
+
+// Pushed last, to make the writer exit.
+Node stop;
+
+// A stack that threads push to without locking. The writer takes the
+// whole stack at once and writes it to the manifest (see writeLines).
+class Writer
+{
+    std::filesystem::path manifest;
+    std::atomic<Node *> pushed = nullptr;
+    std::thread thread;
+
+    void run()
+    {
+        while (true) {
+            pushed.wait(nullptr, std::memory_order_acquire);
+            std::vector<Node *> batch;
+            for (auto node = pushed.exchange(nullptr, std::memory_order_acquire); node; node = node->next)
+                batch.push_back(node);
+
+            std::string lines;
+            bool quit = false;
+            // The stack holds the newest first.
+            for (auto node : std::views::reverse(batch)) {
+                if (node == &stop) {
+                    quit = true;
+                    continue;
+                }
+                lines += toLine(node->secret);
+                delete node;
+            }
+            if (!lines.empty())
+                writeLines(manifest, lines);
+            if (quit)
+                return;
+        }
+    }
+
+public:
+    explicit Writer(std::filesystem::path manifest)
+        : manifest(std::move(manifest))
+        , thread([this]() { run(); })
+    {
+    }
+
+    ~Writer()
+    {
+        push(&stop);
+        thread.join();
+    }
+
+    void push(Node * node)
+    {
+        node->next = pushed.load(std::memory_order_relaxed);
+        while (!pushed.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        pushed.notify_one();
+    }
+};
+
+} // namespace
+
+void recordResolved(ResolvedSecret secret)
+{
+    auto manifest = resolvedManifest();
+    if (!manifest || secret.fingerprint.empty() || secret.file.find('\n') != std::string::npos)
+        return;
+    static Writer writer(*manifest);
+    writer.push(new Node{std::move(secret)});
+}
+
+std::vector<ResolvedSecret> loadResolved()
+{
+    auto manifest = resolvedManifest();
+    if (!manifest)
+        return {};
+
+    std::string contents;
+    try {
+        contents = readFile(manifest->string());
+    } catch (Error &) {
+        return {};
+    }
+
+    auto secrets = latestEntries(contents);
+    std::ranges::sort(secrets, std::greater{}, &ResolvedSecret::micros);
+    return secrets;
+}
+
+} // namespace mini_agenix
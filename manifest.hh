@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+// The hash-locked secrets an evaluation resolved, so that the next
+// evaluation can start on them before it asks for them. Evaluations touch
+// almost the same secrets every time. Recording costs the evaluation one
+// lock-free push per secret; a writer thread appends what was pushed to
+// the manifest, and replaces the manifest with a compacted one when it
+// has grown. Only the latest entry per secret counts, and only if its
+// file is unchanged.
+
+namespace mini_agenix {
+
+struct ResolvedSecret
+{
+    // The encrypted file, on disk.
+    std::string file;
+    // "none" or "zstd".
+    std::string compression;
+    // The SRI hash of the plaintext.
+    std::string hash;
+    // The store path of the plaintext.
+    std::string storePath;
+    // The file as it was before the secret was read from it; see
+    // fileFingerprint. Secrets without one are not recorded.
+    std::string fingerprint;
+    // How long the evaluation took to resolve the secret.
+    uint64_t micros = 0;
+};
+
+// $MINI_AGENIX_MANIFEST. Nothing is recorded if it is not set.
+std::optional<std::filesystem::path> resolvedManifest();
+
+// Identifies the contents of a file without reading it, or returns an
+// empty string if it cannot be statted.
+std::string fileFingerprint(const std::filesystem::path & file);
+
+// Queues a secret to be appended to the manifest. Never blocks; errors
+// writing the manifest are ignored. Queued secrets are written at the
+// latest when the process exits.
+void recordResolved(ResolvedSecret secret);
+
+// The secrets in the manifest whose files are unchanged, one per file and
+// compression, most expensive first.
+std::vector<ResolvedSecret> loadResolved();
+
+} // namespace mini_agenix
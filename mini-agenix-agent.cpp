@@ -0,0 +1,311 @@
+// mini-agenix-agent: keeps age identities unlocked for the evaluators of
+// one user, so that a deployment running many `nix eval` processes loads
+// its keys, asks for passphrases and starts plugins once rather than once
+// per process. See agent.hh for the protocol.
+
+#include "agent.hh"
+
+#include <nix/util/environment-variables.hh>
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/hash.hh>
+#include <nix/util/logging.hh>
+#include <nix/util/serialise.hh>
+#include <nix/util/strings.hh>
+
+#include <openssl/crypto.h>
+
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+using namespace nix;
+using namespace mini_agenix;
+
+using Clock = std::chrono::steady_clock;
+
+struct CachedFileKey {
+    FileKey fileKey;
+    Clock::time_point expires;
+};
+
+struct Agent {
+    ParsedIdentities identities;
+    std::chrono::seconds ttl{300};
+
+    // Unwrapped file keys by header hash. Entries are dropped, and their
+    // keys zeroed, once they are older than ttl.
+    std::map<std::string, CachedFileKey> fileKeys;
+
+    // Requests are handled one at a time: plugins may prompt, and
+    // concurrent sessions of the same plugin gain nothing.
+    std::mutex lock;
+
+    void expire()
+    {
+        auto now = Clock::now();
+        for (auto i = fileKeys.begin(); i != fileKeys.end();)
+            if (i->second.expires <= now) {
+                OPENSSL_cleanse(i->second.fileKey.data(), i->second.fileKey.size());
+                i = fileKeys.erase(i);
+            } else
+                ++i;
+    }
+
+    std::optional<FileKey> unwrap(std::string_view data, const AgeHeader & header)
+    {
+        auto key = hashString(HashAlgorithm::SHA256, data.substr(0, header.payloadOffset))
+                       .to_string(HashFormat::Base16, false);
+
+        std::lock_guard guard(lock);
+        expire();
+
+        if (auto i = fileKeys.find(key); i != fileKeys.end())
+            return i->second.fileKey;
+
+        auto fileKey = unwrapFileKey(header, identities.identities);
+
+        std::vector<std::string> errors;
+        for (auto & [name, pluginIdentities] : identities.plugins) {
+            if (fileKey)
+                break;
+            auto result = unwrapWithPlugin(name, pluginIdentities, {&header});
+            fileKey = result.fileKeys[0];
+            errors.insert(errors.end(), result.errors.begin(), result.errors.end());
+        }
+        if (!fileKey && !errors.empty())
+            throw AgeError("%s", concatStringsSep("; ", errors));
+
+        if (fileKey && ttl.count() > 0)
+            fileKeys.insert_or_assign(key, CachedFileKey{*fileKey, Clock::now() + ttl});
+        return fileKey;
+    }
+
+    std::pair<AgentStatus, std::string> handle(AgentOp op, std::string_view data)
+    {
+        if (op != AgentOp::Unwrap && op != AgentOp::Decrypt)
+            return {AgentStatus::Failed, fmt("unknown request %d", uint64_t(op))};
+
+        try {
+            auto header = parseHeader(data);
+            if (!header)
+                return {AgentStatus::Failed, "not a binary age file"};
+
+            auto fileKey = unwrap(data, *header);
+            if (!fileKey)
+                return {AgentStatus::NoIdentity, ""};
+
+            std::string reply;
+            if (op == AgentOp::Unwrap)
+                reply.assign(reinterpret_cast<const char *>(fileKey->data()), fileKey->size());
+            else
+                reply = decryptPayload(*fileKey, data.substr(header->payloadOffset));
+            OPENSSL_cleanse(fileKey->data(), fileKey->size());
+            return {AgentStatus::Ok, std::move(reply)};
+        } catch (Error & e) {
+            return {AgentStatus::Failed, e.what()};
+        }
+    }
+
+    void serve(AutoCloseFD fd)
+    {
+        try {
+            FdSource from(fd.get());
+            FdSink to(fd.get());
+            while (true) {
+                auto op = AgentOp(readNum<uint64_t>(from));
+                auto data = readString(from);
+                auto [status, reply] = handle(op, data);
+                to << uint64_t(status) << reply;
+                to.flush();
+                OPENSSL_cleanse(reply.data(), reply.size());
+            }
+        } catch (EndOfFile &) {
+        } catch (Error & e) {
+            debug("mini-agenix-agent: dropping client: %s", e.what());
+        }
+    }
+};
+
+static std::string readPassphrase(const std::filesystem::path & identityFile)
+{
+    AutoCloseFD tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (!tty)
+        throw SysError("cannot open /dev/tty to ask for the passphrase of '%s'", identityFile.string());
+
+    writeFull(tty.get(), fmt("Enter passphrase for identity file '%s': ", identityFile.string()));
+
+    struct termios saved, noEcho;
+    bool restore = tcgetattr(tty.get(), &saved) == 0;
+    if (restore) {
+        noEcho = saved;
+        noEcho.c_lflag &= ~ECHO;
+        tcsetattr(tty.get(), TCSAFLUSH, &noEcho);
+    }
+    std::string passphrase;
+    try {
+        passphrase = readLine(tty.get());
+    } catch (...) {
+        if (restore)
+            tcsetattr(tty.get(), TCSAFLUSH, &saved);
+        throw;
+    }
+    if (restore)
+        tcsetattr(tty.get(), TCSAFLUSH, &saved);
+    writeFull(tty.get(), "\n");
+    return passphrase;
+}
+
+// Identity files may themselves be age-encrypted with a passphrase, as
+// produced by `age-keygen | age -p`. They are unlocked once, here.
+static ParsedIdentities loadIdentityFile(const std::filesystem::path & path)
+{
+    auto contents = readFile(path.string());
+    auto header = parseHeader(contents);
+    if (!header)
+        return parseIdentities(contents);
+
+    auto fileKey = unwrapFileKey(*header, {scryptIdentity(readPassphrase(path))});
+    if (!fileKey)
+        throw AgeError("incorrect passphrase for identity file '%s'", path.string());
+    auto plaintext = decryptPayload(*fileKey, std::string_view(contents).substr(header->payloadOffset));
+    OPENSSL_cleanse(fileKey->data(), fileKey->size());
+    auto parsed = parseIdentities(plaintext);
+    OPENSSL_cleanse(plaintext.data(), plaintext.size());
+    return parsed;
+}
+
+// Creates the socket in a directory that only the current user can enter.
+static AutoCloseFD listenOn(const std::filesystem::path & socketPath)
+{
+    ensurePrivateDir(socketPath.parent_path());
+
+    struct sockaddr_un addr;
+    auto path = socketPath.string();
+    if (path.size() >= sizeof(addr.sun_path))
+        throw Error("socket path '%s' is too long", path);
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    AutoCloseFD fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!fd)
+        throw SysError("cannot create Unix domain socket");
+
+    // Only a socket that nothing listens on any more is taken over. Of two
+    // agents started at once, the second fails to bind.
+    if (connect(fd.get(), reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0)
+        throw Error("another mini-agenix-agent is already listening on '%s'", path);
+    if (errno == ECONNREFUSED) {
+        if (unlink(path.c_str()) == -1 && errno != ENOENT)
+            throw SysError("removing stale socket '%s'", path);
+    } else if (errno != ENOENT)
+        throw SysError("checking for an agent on '%s'", path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!fd)
+        throw SysError("cannot create Unix domain socket");
+    if (bind(fd.get(), reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1)
+        throw SysError("cannot bind to socket '%s'", path);
+    if (chmod(path.c_str(), 0600) == -1)
+        throw SysError("changing permissions of '%s'", path);
+    if (listen(fd.get(), 16) == -1)
+        throw SysError("cannot listen on socket '%s'", path);
+    return fd;
+}
+
+static bool sameUser(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+static void usage()
+{
+    std::cerr << "usage: mini-agenix-agent [-i IDENTITY]... [--socket PATH] [--ttl SECONDS]\n"
+                 "\n"
+                 "Identities default to $AGE_IDENTITY_FILE. File keys are kept for\n"
+                 "--ttl seconds (default 300, 0 to disable caching).\n";
+}
+
+int main(int argc, char ** argv)
+{
+    std::vector<std::filesystem::path> identityFiles;
+    std::optional<std::filesystem::path> socketPath;
+    Agent agent;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (++i == argc)
+                    throw Error("option '%s' requires an argument", arg);
+                return argv[i];
+            };
+            if (arg == "-i" || arg == "--identity")
+                identityFiles.push_back(value());
+            else if (arg == "--socket")
+                socketPath = value();
+            else if (arg == "--ttl") {
+                auto ttl = string2Int<unsigned>(value());
+                if (!ttl)
+                    throw Error("--ttl requires a number of seconds");
+                agent.ttl = std::chrono::seconds(*ttl);
+            } else if (arg == "-h" || arg == "--help") {
+                usage();
+                return 0;
+            } else
+                throw Error("unknown argument '%s'", arg);
+        }
+
+        if (identityFiles.empty())
+            if (auto env = getEnv("AGE_IDENTITY_FILE"))
+                identityFiles.push_back(*env);
+        if (identityFiles.empty()) {
+            usage();
+            return 2;
+        }
+
+        for (auto & p : identityFiles) {
+            auto parsed = loadIdentityFile(p);
+            if (!parsed.complete)
+                warn("'%s' contains keys that mini-agenix-agent cannot use", p.string());
+            auto & all = agent.identities;
+            all.identities.insert(all.identities.end(), parsed.identities.begin(), parsed.identities.end());
+            for (auto & [name, plugin] : parsed.plugins)
+                all.plugins[name].insert(all.plugins[name].end(), plugin.begin(), plugin.end());
+        }
+
+        // Clients that disconnect early must not kill the agent.
+        signal(SIGPIPE, SIG_IGN);
+
+        auto path = socketPath.value_or(agentSocketPath());
+        auto listener = listenOn(path);
+        printInfo("mini-agenix-agent: listening on '%s'", path.string());
+
+        while (true) {
+            AutoCloseFD client = accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC);
+            if (!client) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                throw SysError("accepting connection");
+            }
+            if (!sameUser(client.get()))
+                continue;
+            std::thread([&agent, fd = std::move(client)]() mutable { agent.serve(std::move(fd)); }).detach();
+        }
+    } catch (std::exception & e) {
+        std::cerr << "mini-agenix-agent: " << e.what() << "\n";
+        return 1;
+    }
+}
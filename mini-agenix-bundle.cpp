@@ -0,0 +1,63 @@
+// mini-agenix-bundle: writes the plaintext of a bundle (see bundle.hh)
+// to stdout, to be encrypted with age and read with
+// builtins.importAgeBundle:
+//
+//   mini-agenix-bundle db-password=db.txt api-token.txt | age -R keys.txt -o secrets.bundle.age
+//
+// The hash to pin in importAgeBundle is printed on stderr.
+
+#include "bundle.hh"
+
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/hash.hh>
+
+#include <filesystem>
+#include <iostream>
+
+#include <unistd.h>
+
+using namespace nix;
+using namespace mini_agenix;
+
+static void usage()
+{
+    std::cerr << "usage: mini-agenix-bundle [NAME=]FILE... > BUNDLE\n"
+                 "\n"
+                 "Entries are named after their file unless NAME is given.\n";
+}
+
+int main(int argc, char ** argv)
+{
+    try {
+        std::map<std::string, std::string> entries;
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if (arg == "-h" || arg == "--help") {
+                usage();
+                return 0;
+            }
+            auto eq = arg.find('=');
+            auto path = std::string(eq == arg.npos ? arg : arg.substr(eq + 1));
+            auto name = eq == arg.npos ? std::filesystem::path(path).filename().string() : std::string(arg.substr(0, eq));
+            if (!entries.emplace(name, readFile(path)).second)
+                throw Error("duplicate entry '%s'", name);
+        }
+        if (entries.empty()) {
+            usage();
+            return 2;
+        }
+
+        auto bundle = packBundle(entries);
+        auto index = readBundleIndex(bundle.size(), [&](uint64_t offset, uint64_t length) {
+            return bundle.substr(offset, length);
+        });
+
+        writeFull(STDOUT_FILENO, bundle);
+        std::cerr << "hash = \"" << hashString(HashAlgorithm::SHA256, index.text).to_string(HashFormat::SRI, true)
+                  << "\";\n";
+    } catch (std::exception & e) {
+        std::cerr << "mini-agenix-bundle: " << e.what() << "\n";
+        return 1;
+    }
+}
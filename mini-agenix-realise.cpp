@@ -0,0 +1,138 @@
+// mini-agenix-realise: makes the store paths handed out by
+// builtins.ageLockedPath valid, so that what the evaluation produced can
+// be built. Run it after evaluating and before building:
+//
+//   nix eval --read-only ... && mini-agenix-realise && nix build ...
+//
+// Until it has run, derivations that refer to those paths cannot be
+// instantiated, which is why the evaluation must not write them.
+//
+// All secrets in the pending manifest (see pending.hh) are passed to
+// builtins.prefetchAge in one `nix eval`, which skips those already in
+// the store, substitutes what it can and decrypts the rest in parallel.
+// Arguments are passed on to `nix eval`.
+
+#include "pending.hh"
+
+#include <nix/util/file-system.hh>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <set>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef NIX_BIN
+#define NIX_BIN "nix"
+#endif
+
+#ifndef PLUGIN_PATH
+#define PLUGIN_PATH "libmini_agenix.so"
+#endif
+
+using namespace nix;
+using namespace mini_agenix;
+
+static void usage()
+{
+    std::cerr << "usage: mini-agenix-realise [NIX-EVAL-OPTION...]\n"
+                 "\n"
+                 "Decrypts the secrets recorded by builtins.ageLockedPath.\n";
+}
+
+static std::string nixString(std::string_view s)
+{
+    std::string quoted = "\"";
+    for (auto c : s) {
+        if (c == '"' || c == '\\' || c == '$')
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+static std::string prefetchExpr(const std::vector<PendingSecret> & secrets)
+{
+    std::set<std::string> seen;
+    std::string expr = "builtins.seq (builtins.prefetchAge [\n";
+    for (auto & secret : secrets) {
+        auto attrs = "  { file = /. + " + nixString(secret.file) + "; hash = " + nixString(secret.hash)
+                     + "; compression = " + nixString(secret.compression) + "; }\n";
+        if (seen.insert(attrs).second)
+            expr += attrs;
+    }
+    return expr + "]) \"\"\n";
+}
+
+static int runNix(const std::filesystem::path & exprFile, char ** extraArgs)
+{
+    std::vector<const char *> args = {
+        NIX_BIN,
+        "eval",
+        "--extra-experimental-features",
+        "nix-command",
+        "--option",
+        "plugin-files",
+        PLUGIN_PATH,
+        "--impure",
+        "--raw",
+        "--file",
+        exprFile.c_str(),
+    };
+    for (; *extraArgs; ++extraArgs)
+        args.push_back(*extraArgs);
+    args.push_back(nullptr);
+
+    auto pid = fork();
+    if (pid == -1)
+        throw SysError("forking");
+    if (pid == 0) {
+        execvp(NIX_BIN, const_cast<char * const *>(args.data()));
+        std::cerr << "mini-agenix-realise: cannot run " << NIX_BIN << ": " << strerror(errno) << "\n";
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+        if (errno != EINTR)
+            throw SysError("waiting for nix");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1 && (std::string_view(argv[1]) == "-h" || std::string_view(argv[1]) == "--help")) {
+        usage();
+        return 0;
+    }
+
+    std::vector<PendingSecret> secrets;
+    try {
+        secrets = takePending();
+        if (secrets.empty())
+            return 0;
+
+        auto exprFile = pendingManifest();
+        exprFile += "." + std::to_string(getpid()) + ".nix";
+        writeFile(exprFile.string(), prefetchExpr(secrets));
+        auto status = runNix(exprFile, argv + 1);
+        std::filesystem::remove(exprFile);
+        if (status == 0)
+            return 0;
+
+        // Leave them for the next run.
+        for (auto & secret : secrets)
+            appendPending(secret);
+        return status;
+    } catch (std::exception & e) {
+        std::cerr << "mini-agenix-realise: " << e.what() << "\n";
+        for (auto & secret : secrets)
+            try {
+                appendPending(secret);
+            } catch (...) {
+            }
+        return 1;
+    }
+}
@@ -3,6 +3,7 @@
   stdenv,
   pkg-config,
   nix,
+  openssl,
   age,
 }:
 
@@ -13,22 +14,45 @@ stdenv.mkDerivation {
   src = lib.cleanSource ./.;
 
   nativeBuildInputs = [ pkg-config ];
-  buildInputs = [ nix ];
+  buildInputs = [
+    nix
+    openssl
+  ];
 
   buildPhase = ''
     runHook preBuild
     $CXX -shared -fPIC -std=c++20 -O2 \
-      $(pkg-config --cflags nix-expr nix-store) \
+      $(pkg-config --cflags nix-expr nix-fetchers nix-store libcrypto) \
       -DAGE_PATH='"${lib.getExe age}"' \
       -o libmini_agenix.so \
-      plugin.cpp \
-      $(pkg-config --libs nix-expr nix-store)
+      plugin.cpp age.cpp agent.cpp arena.cpp base64.cpp batchread.cpp bundle.cpp cbor.cpp keyring.cpp manifest.cpp pending.cpp \
+      $(pkg-config --libs nix-expr nix-fetchers nix-store libcrypto)
+    $CXX -std=c++20 -O2 \
+      $(pkg-config --cflags nix-util libcrypto) \
+      -o mini-agenix-agent \
+      mini-agenix-agent.cpp age.cpp agent.cpp base64.cpp \
+      $(pkg-config --libs nix-util libcrypto)
+    $CXX -std=c++20 -O2 \
+      $(pkg-config --cflags nix-util) \
+      -o mini-agenix-bundle \
+      mini-agenix-bundle.cpp bundle.cpp \
+      $(pkg-config --libs nix-util)
+    $CXX -std=c++20 -O2 \
+      $(pkg-config --cflags nix-util libcrypto) \
+      -DNIX_BIN='"${nix}/bin/nix"' \
+      -DPLUGIN_PATH="\"$out/lib/libmini_agenix.so\"" \
+      -o mini-agenix-realise \
+      mini-agenix-realise.cpp pending.cpp agent.cpp age.cpp base64.cpp \
+      $(pkg-config --libs nix-util libcrypto)
     runHook postBuild
   '';
 
   installPhase = ''
     runHook preInstall
     install -D -m 444 libmini_agenix.so $out/lib/libmini_agenix.so
+    install -D -m 555 mini-agenix-agent $out/bin/mini-agenix-agent
+    install -D -m 555 mini-agenix-bundle $out/bin/mini-agenix-bundle
+    install -D -m 555 mini-agenix-realise $out/bin/mini-agenix-realise
     runHook postInstall
   '';
 
@@ -0,0 +1,104 @@
+#include "pending.hh"
+#include "agent.hh"
+
+#include <nix/util/environment-variables.hh>
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/file-system.hh>
+
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mini_agenix {
+
+using namespace nix;
+
+std::filesystem::path pendingManifest()
+{
+    if (auto env = getEnv("MINI_AGENIX_PENDING"))
+        return *env;
+    auto dir = userRuntimeDir();
+    ensurePrivateDir(dir);
+    return dir / "pending";
+}
+
+// Opens and locks the manifest, or returns a closed descriptor if it
+// does not exist and `create` is false. A manifest that takePending
+// renamed while this waited for the lock is opened again, so that nothing
+// is appended to a manifest that has already been taken.
+static AutoCloseFD openLocked(const std::filesystem::path & path, bool create)
+{
+    while (true) {
+        AutoCloseFD fd = ::open(path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+        if (!fd) {
+            if (errno == ENOENT && !create)
+                return fd;
+            throw SysError("opening '%s'", path.string());
+        }
+        if (flock(fd.get(), LOCK_EX) == -1)
+            throw SysError("locking '%s'", path.string());
+        struct stat opened, current;
+        if (fstat(fd.get(), &opened) == -1)
+            throw SysError("statting '%s'", path.string());
+        if (stat(path.c_str(), &current) == 0 && current.st_dev == opened.st_dev && current.st_ino == opened.st_ino)
+            return fd;
+    }
+}
+
+// One line per secret: hash, compression and file, separated by tabs.
+// The file comes last, so it may contain tabs, but not line breaks.
+void appendPending(const PendingSecret & secret)
+{
+    if (secret.file.find('\n') != std::string::npos)
+        throw Error("cannot record '%s' for mini-agenix-realise: its name contains a line break", secret.file);
+
+    auto line = secret.hash + "\t" + secret.compression + "\t" + secret.file + "\n";
+    auto path = pendingManifest();
+    auto fd = openLocked(path, true);
+    // Every evaluation records the secrets it refers to; a secret already
+    // in the manifest is not appended again, so that the manifest does not
+    // grow while mini-agenix-realise is not run.
+    if (("\n" + drainFD(fd.get())).find("\n" + line) != std::string::npos)
+        return;
+    writeFull(fd.get(), line);
+}
+
+std::vector<PendingSecret> takePending()
+{
+    auto path = pendingManifest();
+    auto fd = openLocked(path, false);
+    if (!fd)
+        return {};
+    auto taken = path;
+    taken += "." + std::to_string(getpid());
+    if (rename(path.c_str(), taken.c_str()) == -1)
+        throw SysError("taking '%s'", path.string());
+
+    auto contents = drainFD(fd.get());
+    fd.close();
+    std::filesystem::remove(taken);
+
+    std::vector<PendingSecret> secrets;
+    for (size_t start = 0, end; start < contents.size(); start = end + 1) {
+        end = contents.find('\n', start);
+        if (end == std::string::npos)
+            end = contents.size();
+        std::string_view line(contents.data() + start, end - start);
+        auto tab1 = line.find('\t');
+        auto tab2 = tab1 == line.npos ? line.npos : line.find('\t', tab1 + 1);
+        if (tab2 == line.npos)
+            continue;
+        secrets.push_back({
+            .file = std::string(line.substr(tab2 + 1)),
+            .hash = std::string(line.substr(0, tab1)),
+            .compression = std::string(line.substr(tab1 + 1, tab2 - tab1 - 1)),
+        });
+    }
+    return secrets;
+}
+
+} // namespace mini_agenix
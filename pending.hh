@@ -0,0 +1,36 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// The secrets whose store paths builtins.ageLockedPath handed out without
+// checking that they exist. Evaluators append to a per-user manifest, and
+// mini-agenix-realise takes the whole manifest and realises every path in
+// it before the evaluation's results are built.
+
+namespace mini_agenix {
+
+struct PendingSecret
+{
+    // The encrypted file, on disk.
+    std::string file;
+    // The SRI hash of the plaintext.
+    std::string hash;
+    // "none" or "zstd".
+    std::string compression;
+};
+
+// $MINI_AGENIX_PENDING, or pending in userRuntimeDir().
+std::filesystem::path pendingManifest();
+
+// Appends a secret to the manifest, unless it is already in it. The
+// manifest is locked meanwhile, so appends from other processes neither
+// interleave nor land in a manifest that takePending has taken.
+void appendPending(const PendingSecret & secret);
+
+// Empties the manifest and returns what it held, so that secrets
+// appended meanwhile are left for the next call.
+std::vector<PendingSecret> takePending();
+
+} // namespace mini_agenix
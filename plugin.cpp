@@ -1,16 +1,63 @@
 #include <nix/expr/eval.hh>
+#include <nix/expr/json-to-value.hh>
+#include <nix/expr/nixexpr.hh>
 #include <nix/expr/primops.hh>
+#include <nix/fetchers/cache.hh>
+#include <nix/fetchers/fetchers.hh>
+#include <nix/fetchers/store-path-accessor.hh>
 #include <nix/store/content-address.hh>
+#include <nix/store/pathlocks.hh>
 #include <nix/store/store-api.hh>
+#include <nix/util/compression.hh>
 #include <nix/util/environment-variables.hh>
+#include <nix/util/file-descriptor.hh>
 #include <nix/util/file-system.hh>
+#include <nix/util/finally.hh>
 #include <nix/util/hash.hh>
 #include <nix/util/logging.hh>
+#include <nix/util/memory-source-accessor.hh>
 #include <nix/util/processes.hh>
 #include <nix/util/serialise.hh>
+#include <nix/util/strings.hh>
+#include <nix/util/sync.hh>
+#include <nix/util/thread-pool.hh>
+#include <nix/util/url.hh>
+#include <nix/util/util.hh>
 #include <nix/util/users.hh>
 
+#include "age.hh"
+#include "agent.hh"
+#include "arena.hh"
+#include "base64.hh"
+#include "batchread.hh"
+#include "bundle.hh"
+#include "cbor.hh"
+#include "keyring.hh"
+#include "manifest.hh"
+#include "pending.hh"
+
+#include <openssl/crypto.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <set>
+#include <thread>
+#include <variant>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifndef AGE_PATH
 #define AGE_PATH "age"
@@ -46,15 +93,173 @@ static IdentityDiscovery discoverIdentities()
     return result;
 }
 
-static std::string decryptWithAge(const std::filesystem::path & encryptedPath, const std::vector<std::filesystem::path> & identities)
+// The ciphertext goes to age on stdin, so it never has to exist as a file
+// on the host filesystem.
+static std::string decryptWithAge(std::string_view ciphertext, const std::vector<std::filesystem::path> & identities)
 {
     Strings args = {"--decrypt"};
     for (auto & id : identities) {
         args.push_back("-i");
         args.push_back(id.string());
     }
-    args.push_back(encryptedPath.string());
-    return runProgram(AGE_PATH, false, args);
+
+    auto [status, plaintext] = runProgram(RunOptions{
+        .program = AGE_PATH,
+        .args = args,
+        .input = std::string(ciphertext),
+    });
+    if (!statusOk(status))
+        throw ExecError(status, "program '%1%' %2%", AGE_PATH, statusToString(status));
+    return plaintext;
+}
+
+struct CachedIdentities {
+    std::filesystem::file_time_type mtime;
+    mini_agenix::ParsedIdentities parsed;
+};
+
+// Identities that can be used in-process, parsed once per identity file
+// and kept for the lifetime of the evaluator, so that key parsing and the
+// derived key material (RSA CRT parameters, X25519 public keys) are not
+// recomputed for every secret. An entry is reparsed when its file changes.
+static mini_agenix::ParsedIdentities loadIdentities(const std::vector<std::filesystem::path> & identityFiles)
+{
+    // Never destroyed, like the other registries prefetch threads use,
+    // as those may still run when statics are destroyed at exit.
+    static auto & cache = *new Sync<std::map<std::filesystem::path, CachedIdentities>>;
+
+    mini_agenix::ParsedIdentities result;
+    for (auto & p : identityFiles) {
+        try {
+            auto mtime = std::filesystem::last_write_time(p);
+            auto cache_(cache.lock());
+            auto i = cache_->find(p);
+            if (i == cache_->end() || i->second.mtime != mtime)
+                i = cache_
+                        ->insert_or_assign(
+                            p, CachedIdentities{mtime, mini_agenix::parseIdentities(readFile(p.string()))})
+                        .first;
+            auto & parsed = i->second.parsed;
+            result.identities.insert(result.identities.end(), parsed.identities.begin(), parsed.identities.end());
+            for (auto & [name, plugin] : parsed.plugins)
+                result.plugins[name].insert(result.plugins[name].end(), plugin.begin(), plugin.end());
+            result.complete &= parsed.complete;
+        } catch (std::exception &) {
+            // Leave unreadable identity files to age, which reports them.
+            result.complete = false;
+        }
+    }
+    return result;
+}
+
+// File keys unwrapped by age plugins, by header hash. A plugin session
+// can unwrap the stanzas of many files at once, so batches fill this up
+// front and later lookups of the same header never start the plugin.
+// Never destroyed (see loadIdentities).
+static auto & pluginFileKeys = *new Sync<std::map<std::string, mini_agenix::FileKey>>;
+
+static std::string headerKey(std::string_view headerBytes)
+{
+    return hashString(HashAlgorithm::SHA256, headerBytes).to_string(HashFormat::Base16, false);
+}
+
+using PendingHeaders = std::vector<std::pair<std::string, const mini_agenix::AgeHeader *>>;
+
+// Runs one session per plugin for all headers not yet in pluginFileKeys.
+// Returns the errors reported by the plugins.
+static std::vector<std::string>
+unwrapWithPlugins(const mini_agenix::ParsedIdentities & identities, const PendingHeaders & pending)
+{
+    std::vector<std::string> errors;
+
+    for (auto & [name, pluginIdentities] : identities.plugins) {
+        std::vector<std::string> keys;
+        std::vector<const mini_agenix::AgeHeader *> headers;
+        {
+            auto pluginFileKeys_(pluginFileKeys.lock());
+            for (auto & [key, header] : pending)
+                if (!pluginFileKeys_->count(key)) {
+                    keys.push_back(key);
+                    headers.push_back(header);
+                }
+        }
+        if (headers.empty())
+            break;
+
+        auto result = mini_agenix::unwrapWithPlugin(name, pluginIdentities, headers);
+        auto pluginFileKeys_(pluginFileKeys.lock());
+        for (size_t i = 0; i < keys.size(); ++i)
+            if (result.fileKeys[i])
+                pluginFileKeys_->emplace(keys[i], *result.fileKeys[i]);
+        errors.insert(errors.end(), result.errors.begin(), result.errors.end());
+    }
+
+    return errors;
+}
+
+// Unwraps the file key in-process if the kernel keyring holds it, or one
+// of the identities, or an age plugin, can unwrap it. Returns std::nullopt
+// if the file has to go through the age binary (scrypt, unsupported key
+// types, plugins that fail or prompt, ...).
+static std::optional<mini_agenix::FileKey> unwrapNative(
+    std::string_view headerBytes,
+    const mini_agenix::AgeHeader & header,
+    const std::vector<std::filesystem::path> & identityFiles)
+{
+    auto key = headerKey(headerBytes);
+
+    auto keyring = mini_agenix::keyringSettings();
+    if (keyring)
+        if (auto fileKey = mini_agenix::keyringLookup(*keyring, key);
+            fileKey && mini_agenix::verifyHeaderMac(header, *fileKey))
+            return fileKey;
+
+    auto identities = loadIdentities(identityFiles);
+
+    auto fileKey = mini_agenix::unwrapFileKey(header, identities.identities);
+    if (!fileKey && !identities.plugins.empty()) {
+        auto cached = [&]() -> std::optional<mini_agenix::FileKey> {
+            auto pluginFileKeys_(pluginFileKeys.lock());
+            if (auto i = pluginFileKeys_->find(key); i != pluginFileKeys_->end())
+                return i->second;
+            return std::nullopt;
+        };
+        fileKey = cached();
+        if (!fileKey) {
+            // A plugin that failed, or wanted a PIN or a touch, may work
+            // through the age binary, which can prompt on the terminal.
+            try {
+                auto errors = unwrapWithPlugins(identities, {{key, &header}});
+                fileKey = cached();
+                if (!fileKey && !errors.empty()) {
+                    debug("leaving the file to age: %s", concatStringsSep("; ", errors));
+                    return std::nullopt;
+                }
+            } catch (mini_agenix::AgeError & e) {
+                debug("leaving the file to age: %s", e.what());
+                return std::nullopt;
+            }
+        }
+    }
+
+    if (fileKey && keyring)
+        mini_agenix::keyringStore(*keyring, key, *fileKey);
+
+    return fileKey;
+}
+
+// Unwraps the file key with mini-agenix-agent. Returns std::nullopt if no
+// agent is running or it has no file key that matches the header MAC, so
+// that the local identities are tried next.
+static std::optional<mini_agenix::FileKey>
+unwrapWithAgent(std::string_view headerBytes, const mini_agenix::AgeHeader & header)
+{
+    auto fileKey = mini_agenix::agentUnwrap(headerBytes);
+    if (fileKey && !mini_agenix::verifyHeaderMac(header, *fileKey)) {
+        debug("mini-agenix-agent returned a wrong file key");
+        return std::nullopt;
+    }
+    return fileKey;
 }
 
 static std::string stripAgeSuffix(std::string_view name)
@@ -77,40 +282,527 @@ static std::string describeCandidate(const std::filesystem::path & p)
     }
 }
 
-// Core logic shared by importAge and readAge.
-// Decrypts if necessary and ensures the result is in the store.
-// Returns the store path of the decrypted content.
-static StorePath resolveAge(
-    EvalState & state,
-    const PosIdx pos,
-    std::string_view who,
+static std::string secretName(const SourcePath & encryptedFile)
+{
+    return stripAgeSuffix(encryptedFile.path.baseName().value_or("source"));
+}
+
+// Secrets are stored as files (Flat), or for importAgeTree and
+// readAgeTree, as the file system object a NAR plaintext describes
+// (NixArchive). The hash is always that of the plaintext.
+static StorePath lockedStorePath(
+    Store & store, std::string_view name, const Hash & hash, FileIngestionMethod method = FileIngestionMethod::Flat)
+{
+    return store.makeFixedOutputPath(
+        name,
+        FixedOutputInfo{
+            .method = method,
+            .hash = hash,
+            .references = {},
+        });
+}
+
+// ensurePath also tries substituters, so a store path populated on
+// another machine and pushed to a cache can be used here without any
+// local decryption.
+static bool ensureLockedPath(Store & store, const StorePath & path)
+{
+    try {
+        store.ensurePath(path);
+        return true;
+    } catch (Error &) {
+        return false;
+    }
+}
+
+static StorePath addToStore(
+    Store & store,
+    RepairFlag repair,
+    std::string_view name,
+    std::string_view content,
+    FileIngestionMethod method = FileIngestionMethod::Flat,
+    HashAlgorithm hashAlgo = HashAlgorithm::SHA256)
+{
+    auto nar = method == FileIngestionMethod::NixArchive;
+    StringSource source(content);
+    return store.addToStoreFromDump(
+        source,
+        name,
+        nar ? FileSerialisationMethod::NixArchive : FileSerialisationMethod::Flat,
+        ContentAddressMethod{nar ? ContentAddressMethod::Raw::NixArchive : ContentAddressMethod::Raw::Flat},
+        hashAlgo,
+        {},
+        repair);
+}
+
+// Where an evaluator records the plaintext hash of a ciphertext it has
+// decrypted and added to the store, named after the ciphertext's hash. Together
+// with a lock on it, this lets concurrent evaluations of the same secret
+// wait for whichever one gets there first and reuse its store path.
+// Returns std::nullopt if the per-user runtime directory is unusable.
+static std::optional<std::filesystem::path> decryptionRecord(const std::string & ciphertextHash)
+{
+    try {
+        auto dir = mini_agenix::userRuntimeDir();
+        mini_agenix::ensurePrivateDir(dir);
+        mini_agenix::ensurePrivateDir(dir / "decrypted");
+        return dir / "decrypted" / ciphertextHash;
+    } catch (Error & e) {
+        debug("not coordinating decryption with other evaluations: %s", e.what());
+        return std::nullopt;
+    }
+}
+
+static std::optional<Hash> readDecryptionRecord(const std::filesystem::path & record)
+{
+    try {
+        if (!pathExists(record.string()))
+            return std::nullopt;
+        return Hash::parseSRI(trim(readFile(record.string())));
+    } catch (Error &) {
+        return std::nullopt;
+    }
+}
+
+MakeError(NoIdentityError, Error);
+
+static std::string noIdentityMessage(const IdentityDiscovery & discovery, bool hashLocked)
+{
+    std::string detail;
+    if (discovery.candidates.empty()) {
+        detail = "no candidate paths (could not determine home directory)";
+    } else {
+        detail = "checked: ";
+        for (size_t i = 0; i < discovery.candidates.size(); ++i) {
+            if (i > 0)
+                detail += ", ";
+            detail += describeCandidate(discovery.candidates[i]);
+        }
+    }
+
+    auto msg = fmt(
+        "no usable identity found. %s. "
+        "Set AGE_IDENTITY_FILE or ensure a key exists at a default path.",
+        detail);
+
+    if (hashLocked)
+        msg += " The hash-locked store path is not present and no identity was found to decrypt."
+               " You may need to run an initial impure evaluation on a machine with the identity,"
+               " or populate the store path via substitution.";
+
+    return msg;
+}
+
+// Bounds the number of decryptions (age processes, plugin sessions,
+// unwraps) running at once when primops are called from several
+// threads. MINI_AGENIX_JOBS, or the number of CPUs.
+static unsigned decryptionJobs()
+{
+    if (auto jobs = getEnv("MINI_AGENIX_JOBS"))
+        if (auto n = string2Int<unsigned>(*jobs); n && *n > 0)
+            return *n;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+static std::counting_semaphore<> & decryptionSlots()
+{
+    // Never destroyed (see loadIdentities).
+    static auto slots = new std::counting_semaphore<>(decryptionJobs());
+    return *slots;
+}
+
+// A secret opened by openSecret: its file key, for in-process decryption,
+// or its plaintext if only the age binary could decrypt it.
+using OpenedSecret = std::variant<mini_agenix::FileKey, std::string>;
+
+// An age file with its header parsed, if it is one that can be decrypted
+// in-process: a binary file, or an armored one whose header has been
+// decoded. Not movable, as the header points into the decoded bytes.
+struct ParsedSecret {
+    std::string_view ciphertext;
+    std::optional<mini_agenix::ArmoredAge> armored;
+    std::optional<mini_agenix::AgeHeader> header;
+
+    explicit ParsedSecret(std::string_view ciphertext)
+        : ciphertext(ciphertext)
+        , armored(mini_agenix::parseArmor(ciphertext))
+        , header(mini_agenix::parseHeader(armored ? std::string_view(armored->header) : ciphertext))
+    {
+    }
+
+    ParsedSecret(const ParsedSecret &) = delete;
+    ParsedSecret & operator=(const ParsedSecret &) = delete;
+
+    // The header bytes, which identify the file key.
+    std::string_view headerBytes() const
+    {
+        return armored ? std::string_view(armored->header) : ciphertext.substr(0, header->payloadOffset);
+    }
+
+    mini_agenix::SecretBuffer decryptPayload(const mini_agenix::FileKey & fileKey) const
+    {
+        if (armored) {
+            mini_agenix::SecretBuffer plaintext(mini_agenix::armoredPayloadSize(*armored));
+            mini_agenix::decryptArmoredPayloadInto(fileKey, *armored, plaintext.data());
+            return plaintext;
+        }
+        auto payload = ciphertext.substr(header->payloadOffset);
+        mini_agenix::SecretBuffer plaintext(mini_agenix::payloadSize(payload));
+        mini_agenix::decryptPayloadInto(fileKey, payload, plaintext.data());
+        return plaintext;
+    }
+
+    std::string decryptPayloadRange(const mini_agenix::FileKey & fileKey, uint64_t offset, uint64_t length) const
+    {
+        if (armored)
+            return mini_agenix::decryptArmoredPayloadRange(fileKey, *armored, offset, length);
+        return mini_agenix::decryptPayloadRange(fileKey, ciphertext.substr(header->payloadOffset), offset, length);
+    }
+};
+
+// Must be called with a decryption slot held.
+static OpenedSecret openSecret(const ParsedSecret & secret, bool hashLocked)
+{
+    // A running agent needs no identities in this process at all.
+    if (secret.header)
+        if (auto fileKey = unwrapWithAgent(secret.headerBytes(), *secret.header))
+            return *fileKey;
+
+    auto discovery = discoverIdentities();
+    if (discovery.usable.empty())
+        throw NoIdentityError(noIdentityMessage(discovery, hashLocked));
+
+    if (secret.header)
+        if (auto fileKey = unwrapNative(secret.headerBytes(), *secret.header, discovery.usable))
+            return *fileKey;
+
+    return decryptWithAge(secret.ciphertext, discovery.usable);
+}
+
+// Decrypts a secret into a buffer from the plaintext arena.
+static mini_agenix::SecretBuffer decrypt(const std::string & ciphertext, bool hashLocked)
+{
+    decryptionSlots().acquire();
+    Finally release([]() { decryptionSlots().release(); });
+
+    ParsedSecret secret(ciphertext);
+    auto opened = openSecret(secret, hashLocked);
+    if (auto plaintext = std::get_if<std::string>(&opened)) {
+        Finally cleanse([&]() { OPENSSL_cleanse(plaintext->data(), plaintext->size()); });
+        return mini_agenix::SecretBuffer(*plaintext);
+    }
+    return secret.decryptPayload(std::get<mini_agenix::FileKey>(opened));
+}
+
+// Like decrypt, but only with keys at hand that need no interaction: from
+// the agent, the keyring or identity files. Returns std::nullopt where
+// decrypt might prompt, through an age plugin or the age binary (scrypt,
+// encrypted identities), and when all decryption slots are busy.
+static std::optional<mini_agenix::SecretBuffer> decryptSilently(const std::string & ciphertext)
+{
+    if (!decryptionSlots().try_acquire())
+        return std::nullopt;
+    Finally release([]() { decryptionSlots().release(); });
+
+    ParsedSecret secret(ciphertext);
+    if (!secret.header)
+        return std::nullopt;
+    auto fileKey = unwrapWithAgent(secret.headerBytes(), *secret.header);
+    if (!fileKey) {
+        auto usable = discoverIdentities().usable;
+        if (!loadIdentities(usable).plugins.empty())
+            return std::nullopt;
+        fileKey = unwrapNative(secret.headerBytes(), *secret.header, usable);
+    }
+    if (!fileKey)
+        return std::nullopt;
+    return secret.decryptPayload(*fileKey);
+}
+
+// Decrypts the plaintext bytes [offset, offset + length) of a secret. In
+// process, only the STREAM chunks overlapping the range are touched; the
+// age binary can only decrypt the whole file.
+static std::string decryptRange(std::string_view ciphertext, uint64_t offset, uint64_t length)
+{
+    decryptionSlots().acquire();
+    Finally release([]() { decryptionSlots().release(); });
+
+    ParsedSecret secret(ciphertext);
+    auto opened = openSecret(secret, false);
+    auto plaintext = std::get_if<std::string>(&opened);
+    if (!plaintext)
+        return secret.decryptPayloadRange(std::get<mini_agenix::FileKey>(opened), offset, length);
+
+    Finally cleanse([&]() { OPENSSL_cleanse(plaintext->data(), plaintext->size()); });
+    if (offset > plaintext->size() || length > plaintext->size() - offset)
+        throw mini_agenix::AgeError(
+            "range %d+%d is outside the %d bytes of the plaintext", offset, length, plaintext->size());
+    return plaintext->substr(offset, length);
+}
+
+// How the plaintext was compressed before it was encrypted. The hash of a
+// compressed secret is that of its decompressed contents.
+enum class Compression { None, Zstd };
+
+// The algorithm to hash a plaintext with: that of the expected hash, or
+// SHA-256 for the hash printed when there is none.
+static HashAlgorithm plaintextHashAlgo(const std::optional<Hash> & expectedHash)
+{
+    return expectedHash ? expectedHash->algo : HashAlgorithm::SHA256;
+}
+
+// Hashes a plaintext like expectedHash. Compressed plaintext is
+// decompressed as a stream, and each decompressed block is hashed as it
+// comes out, so the contents are only traversed once.
+static std::pair<mini_agenix::SecretBuffer, Hash>
+hashPlaintext(mini_agenix::SecretBuffer plaintext, const std::optional<Hash> & expectedHash, Compression compression)
+{
+    auto algo = plaintextHashAlgo(expectedHash);
+    if (compression == Compression::None) {
+        auto hash = hashString(algo, plaintext.view());
+        return {std::move(plaintext), hash};
+    }
+
+    mini_agenix::SecretBuffer content;
+    HashSink hashSink(algo);
+    LambdaSink tee([&](std::string_view data) {
+        content.append(data);
+        hashSink(data);
+    });
+    try {
+        auto decompressor = makeDecompressionSink("zstd", tee);
+        (*decompressor)(plaintext.view());
+        decompressor->finish();
+    } catch (Error & e) {
+        throw mini_agenix::AgeError("cannot decompress the plaintext with zstd: %s", e.info().msg.str());
+    }
+
+    auto [hash, size] = hashSink.finish();
+    return {std::move(content), hash};
+}
+
+static std::pair<mini_agenix::SecretBuffer, Hash>
+decryptAndHash(const std::string & ciphertext, const std::optional<Hash> & expectedHash, Compression compression)
+{
+    return hashPlaintext(decrypt(ciphertext, expectedHash.has_value()), expectedHash, compression);
+}
+
+// Distinguishes decryptions of one ciphertext whose plaintext hashes
+// differ: decompressed or not, and hashed with another algorithm.
+static std::string variantSuffix(const std::optional<Hash> & expectedHash, Compression compression)
+{
+    std::string suffix = compression == Compression::Zstd ? "-zstd" : "";
+    if (auto algo = plaintextHashAlgo(expectedHash); algo != HashAlgorithm::SHA256)
+        suffix += "-" + std::string(printHashAlgo(algo));
+    return suffix;
+}
+
+// A secret that prefetchAge has read and hashed ahead of decryptOnce. The
+// hash is empty if the secret was only read.
+struct BatchedSecret {
+    std::string ciphertext;
+    std::string ciphertextHash;
+    // Set for a prefetch that no evaluation waits for. It gives up,
+    // throwing PrefetchAbandoned, rather than wait for a lock or ask for
+    // anything, and as soon as the flag it points to is set.
+    const std::atomic<bool> * speculative = nullptr;
+};
+
+MakeError(PrefetchAbandoned, Error);
+
+// Decrypts for a speculative prefetch: only what needs neither a prompt
+// nor an age plugin, and only while it is not stopped.
+static std::pair<mini_agenix::SecretBuffer, Hash> decryptSpeculatively(
+    const std::string & ciphertext,
+    const std::optional<Hash> & expectedHash,
+    Compression compression,
+    const std::atomic<bool> & stop)
+{
+    if (stop)
+        throw PrefetchAbandoned("the prefetch was stopped");
+    auto plaintext = decryptSilently(ciphertext);
+    if (!plaintext)
+        throw PrefetchAbandoned("the secret cannot be decrypted without asking");
+    return hashPlaintext(std::move(*plaintext), expectedHash, compression);
+}
+
+struct Decryption {
+    Hash hash;
+    // The plaintext, if this process decrypted it, shared with every
+    // thread that waited for the decryption.
+    std::shared_ptr<const mini_agenix::SecretBuffer> content;
+    // Whether the plaintext is in the store under `hash`.
+    bool stored;
+};
+
+// Adds a plaintext to the store and checks that it lands at the store
+// path its hash locks: a NAR with trailing data would be stored under the
+// hash of less than the whole plaintext. `what` names the secret.
+static StorePath addDecryptedToStore(
+    Store & store,
+    RepairFlag repair,
+    const std::string & name,
+    std::string_view content,
+    const Hash & hash,
+    FileIngestionMethod method,
+    std::string_view what)
+{
+    auto storePath = addToStore(store, repair, name, content, method, hash.algo);
+    if (storePath != lockedStorePath(store, name, hash, method))
+        throw Error("the decrypted contents of %s are not a canonical NAR", what);
+    return storePath;
+}
+
+// The hash of a secret that an evaluation decrypted and recorded, if it
+// is the expected one and its store path is still valid.
+static std::optional<Hash> recordedDecryption(
+    Store & store,
+    const std::filesystem::path & record,
+    const std::string & name,
+    const std::optional<Hash> & expectedHash,
+    FileIngestionMethod method)
+{
+    if (auto recorded = readDecryptionRecord(record); recorded && (!expectedHash || *recorded == *expectedHash))
+        if (store.isValidPath(lockedStorePath(store, name, *recorded, method)))
+            return recorded;
+    return std::nullopt;
+}
+
+// Decrypts a secret and adds it to the store as `name`, unless its hash
+// differs from expectedHash. Only one evaluator process at a time does
+// this for a given ciphertext; the others wait and then use the store
+// path it recorded, or decrypt themselves if it failed.
+static Decryption decryptToStore(
+    Store & store,
+    RepairFlag repair,
+    const std::string & name,
     const SourcePath & encryptedFile,
-    std::optional<Hash> expectedHash)
+    const std::string & ciphertext,
+    const std::string & ciphertextHash,
+    const std::optional<Hash> & expectedHash,
+    FileIngestionMethod method,
+    Compression compression,
+    BatchedSecret * batched)
 {
-    auto baseName = encryptedFile.path.baseName();
-    auto name = stripAgeSuffix(baseName.value_or("source"));
+    auto speculative = batched ? batched->speculative : nullptr;
 
-    if (expectedHash) {
-        if (expectedHash->algo != HashAlgorithm::SHA256)
-            state.error<EvalError>("%s only supports SHA-256 hashes", who).atPos(pos).debugThrow();
+    PathLocks lock;
+    lock.setDeletion(true);
+    auto record = decryptionRecord(ciphertextHash + variantSuffix(expectedHash, compression));
+    if (record) {
+        if (!lock.lockPaths({record->string()}, "", false)) {
+            if (speculative)
+                throw PrefetchAbandoned("another evaluation is decrypting '%s'", encryptedFile);
+            lock.lockPaths({record->string()}, fmt("waiting for another evaluation to decrypt '%s'", encryptedFile));
+        }
+        // Checked under the lock, so that the evaluation that just
+        // released it, or any earlier one, is not repeated.
+        if (auto recorded = recordedDecryption(store, *record, name, expectedHash, method))
+            return {*recorded, nullptr, true};
 
-        auto expectedPath = state.store->makeFixedOutputPath(
-            name,
-            FixedOutputInfo{
-                .method = FileIngestionMethod::Flat,
-                .hash = *expectedHash,
-                .references = {},
-            });
+        // Waiters must only see a record written under this lock.
+        std::error_code ec;
+        std::filesystem::remove(*record, ec);
+    }
+
+    auto [content, hash] = speculative ? decryptSpeculatively(ciphertext, expectedHash, compression, *speculative)
+                                       : decryptAndHash(ciphertext, expectedHash, compression);
+    if (expectedHash && hash != *expectedHash)
+        return {hash, std::make_shared<const mini_agenix::SecretBuffer>(std::move(content)), false};
+    if (speculative && *speculative)
+        throw PrefetchAbandoned("the prefetch was stopped");
 
-        // ensurePath also tries substituters, so a store path populated
-        // on another machine and pushed to a cache can be used here
-        // without any local decryption.
+    addDecryptedToStore(store, repair, name, content.view(), hash, method, fmt("'%s'", encryptedFile));
+
+    if (record) {
         try {
-            state.store->ensurePath(expectedPath);
-            return expectedPath;
-        } catch (Error &) {
-            // Fall through to decryption.
+            writeFile(record->string(), hash.to_string(HashFormat::SRI, true));
+        } catch (Error & e) {
+            debug("cannot record decryption of '%s': %s", encryptedFile, e.what());
+        }
+    }
+
+    return {hash, std::make_shared<const mini_agenix::SecretBuffer>(std::move(content)), true};
+}
+
+// Decryptions in progress in this process, by ciphertext hash and name.
+// Primop calls from other threads for the same secret wait for the same
+// result instead of decrypting again. Never destroyed, as a prefetch left
+// behind at exit still erases its entry when it is done.
+static auto & inFlight = *new Sync<std::map<std::string, std::shared_future<Decryption>>>;
+
+static Decryption decryptOnce(
+    Store & store,
+    RepairFlag repair,
+    const std::string & name,
+    const SourcePath & encryptedFile,
+    const std::string & ciphertext,
+    const std::optional<Hash> & expectedHash,
+    FileIngestionMethod method,
+    Compression compression,
+    BatchedSecret * batched)
+{
+    auto ciphertextHash = batched && !batched->ciphertextHash.empty()
+                              ? batched->ciphertextHash
+                              : hashString(HashAlgorithm::SHA256, ciphertext).to_string(HashFormat::Base16, false);
+    auto key = ciphertextHash + "-" + name + (method == FileIngestionMethod::NixArchive ? "-nar" : "")
+               + variantSuffix(expectedHash, compression);
+    auto speculative = batched && batched->speculative;
+
+    while (true) {
+        std::promise<Decryption> promise;
+        std::shared_future<Decryption> result;
+        bool owner = false;
+        {
+            auto inFlight_(inFlight.lock());
+            auto i = inFlight_->find(key);
+            if (i == inFlight_->end()) {
+                i = inFlight_->emplace(key, promise.get_future().share()).first;
+                owner = true;
+            } else if (speculative)
+                throw PrefetchAbandoned("'%s' is being decrypted already", encryptedFile);
+            result = i->second;
+        }
+
+        // Erased before the result is set, so that waiters that retry
+        // below do not find the same entry again.
+        if (owner) {
+            try {
+                auto decryption = decryptToStore(
+                    store,
+                    repair,
+                    name,
+                    encryptedFile,
+                    ciphertext,
+                    ciphertextHash,
+                    expectedHash,
+                    method,
+                    compression,
+                    batched);
+                inFlight.lock()->erase(key);
+                promise.set_value(std::move(decryption));
+            } catch (...) {
+                inFlight.lock()->erase(key);
+                promise.set_exception(std::current_exception());
+            }
+        }
+
+        try {
+            return result.get();
+        } catch (PrefetchAbandoned &) {
+            // A prefetch gave up on the secret; decrypt it here instead.
+            if (speculative)
+                throw;
         }
+    }
+}
+
+// Checks the 'hash' attribute, which is required in pure evaluation mode.
+static void checkExpectedHash(EvalState & state, const PosIdx pos, std::string_view who, const std::optional<Hash> & expectedHash)
+{
+    if (expectedHash) {
+        if (expectedHash->algo != HashAlgorithm::SHA256 && expectedHash->algo != HashAlgorithm::BLAKE3)
+            state.error<EvalError>("%s only supports SHA-256 and BLAKE3 hashes", who).atPos(pos).debugThrow();
     } else if (state.settings.pureEval) {
         state
             .error<EvalError>(
@@ -121,64 +813,119 @@ static StorePath resolveAge(
             .atPos(pos)
             .debugThrow();
     }
+}
 
-    auto discovery = discoverIdentities();
+static void checkCiphertextExists(EvalState & state, const PosIdx pos, std::string_view who, const SourcePath & encryptedFile)
+{
+    // Go through the source accessor, so that secrets in lazily fetched
+    // or virtual source trees do not have to be copied to disk first.
+    if (!encryptedFile.pathExists())
+        state
+            .error<EvalError>(
+                "%s: file '%s' does not exist. "
+                "If you are using flakes, ensure the file has been added to git.",
+                who,
+                encryptedFile)
+            .atPos(pos)
+            .debugThrow();
+}
 
-    if (discovery.usable.empty()) {
-        std::string detail;
-        if (discovery.candidates.empty()) {
-            detail = "no candidate paths (could not determine home directory)";
-        } else {
-            detail = "checked: ";
-            for (size_t i = 0; i < discovery.candidates.size(); ++i) {
-                if (i > 0)
-                    detail += ", ";
-                detail += describeCandidate(discovery.candidates[i]);
-            }
+static std::string readCiphertext(EvalState & state, const PosIdx pos, std::string_view who, const SourcePath & encryptedFile)
+{
+    checkCiphertextExists(state, pos, who, encryptedFile);
+    return encryptedFile.readFile();
+}
+
+// A file mapped instead of read if it is on disk: a ciphertext, so that
+// decrypting part of a large file only pages in the chunks it needs, or
+// a plaintext in the store, so that it is not copied to the heap before
+// it is copied into a Nix value. The file must not be truncated while it
+// is mapped.
+class MappedFile
+{
+    std::string contents;
+    void * mapping = MAP_FAILED;
+    size_t size = 0;
+
+    bool map(const std::filesystem::path & path)
+    {
+        AutoCloseFD fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd && fstat(fd.get(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            size = st.st_size;
+            mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
         }
+        return mapping != MAP_FAILED;
+    }
 
-        auto msg = fmt(
-            "%s: no usable identity found. %s. "
-            "Set AGE_IDENTITY_FILE or ensure a key exists at a default path.",
-            who,
-            detail);
+public:
+    explicit MappedFile(const SourcePath & file)
+    {
+        if (auto physical = file.getPhysicalPath(); physical && map(*physical))
+            return;
+        contents = file.readFile();
+    }
+
+    explicit MappedFile(const std::filesystem::path & path)
+    {
+        if (!map(path))
+            contents = nix::readFile(path.string());
+    }
 
-        if (expectedHash)
-            msg += " The hash-locked store path is not present and no identity was found to decrypt."
-                   " You may need to run an initial impure evaluation on a machine with the identity,"
-                   " or populate the store path via substitution.";
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
 
-        state.error<ThrownError>("%s", msg).atPos(pos).debugThrow();
+    ~MappedFile()
+    {
+        if (mapping != MAP_FAILED)
+            munmap(mapping, size);
     }
 
-    auto encryptedPath = std::filesystem::path(encryptedFile.path.abs());
+    std::string_view view() const
+    {
+        return mapping != MAP_FAILED ? std::string_view(static_cast<const char *>(mapping), size)
+                                     : std::string_view(contents);
+    }
+};
 
-    if (!std::filesystem::exists(encryptedPath))
+// Turns the exception being handled into an evaluation error at pos.
+[[noreturn]] static void
+rethrowDecryptError(EvalState & state, const PosIdx pos, std::string_view who, const SourcePath & encryptedFile)
+{
+    try {
+        throw;
+    } catch (NoIdentityError & e) {
+        state.error<ThrownError>("%s", fmt("%s: %s", who, e.info().msg.str())).atPos(pos).debugThrow();
+    } catch (ExecError & e) {
         state
             .error<EvalError>(
-                "%s: file '%s' does not exist. "
-                "If you are using flakes, ensure the file has been added to git.",
+                "%s: age failed to decrypt '%s': %s",
                 who,
-                encryptedFile)
+                encryptedFile,
+                e.what())
             .atPos(pos)
             .debugThrow();
-
-    std::string content;
-    try {
-        content = decryptWithAge(encryptedPath, discovery.usable);
-    } catch (ExecError & e) {
+    } catch (mini_agenix::AgeError & e) {
         state
             .error<EvalError>(
-                "%s: age failed to decrypt '%s': %s",
+                "%s: failed to decrypt '%s': %s",
                 who,
                 encryptedFile,
                 e.what())
             .atPos(pos)
             .debugThrow();
     }
+}
 
-    auto actualHash = hashString(HashAlgorithm::SHA256, content);
-
+// Fails on a hash mismatch, and prints the hash to pin if none was given.
+static void checkActualHash(
+    EvalState & state,
+    const PosIdx pos,
+    std::string_view who,
+    const SourcePath & encryptedFile,
+    const std::optional<Hash> & expectedHash,
+    const Hash & actualHash)
+{
     if (expectedHash && actualHash != *expectedHash)
         state
             .error<EvalError>(
@@ -193,39 +940,565 @@ static StorePath resolveAge(
             .atPos(pos)
             .debugThrow();
 
-    StringSource source(content);
-    auto storePath = state.store->addToStoreFromDump(
-        source,
-        name,
-        FileSerialisationMethod::Flat,
-        ContentAddressMethod{ContentAddressMethod::Raw::Flat},
-        HashAlgorithm::SHA256,
-        {},
-        state.repair);
-
     if (!expectedHash)
         warn(
             "%s: hash for '%s' is:\n  hash = \"%s\";",
             who,
             encryptedFile,
             actualHash.to_string(HashFormat::SRI, true));
-
-    return storePath;
 }
 
-struct AgeAttrs {
-    SourcePath file;
-    std::optional<Hash> hash;
+// A secret as the manifest will record it, noted before the secret is
+// read so that a file changed in the meantime no longer matches. Only
+// secrets stored as files under an expected hash are recorded: the next
+// evaluation can only prefetch those without decrypting them again.
+struct ManifestEntry
+{
+    std::string file;
+    std::string fingerprint;
 };
 
-static AgeAttrs parseAgeAttrs(EvalState & state, const PosIdx pos, Value ** args, std::string_view who)
+static std::optional<ManifestEntry> manifestEntry(
+    const SourcePath & encryptedFile, const std::optional<Hash> & expectedHash, FileIngestionMethod method)
 {
-    state.forceAttrs(*args[0], pos, fmt("while evaluating the argument passed to '%s'", who));
+    if (!expectedHash || method != FileIngestionMethod::Flat || !mini_agenix::resolvedManifest())
+        return std::nullopt;
+    try {
+        if (auto physical = encryptedFile.getPhysicalPath()) {
+            auto fingerprint = mini_agenix::fileFingerprint(*physical);
+            if (!fingerprint.empty())
+                return ManifestEntry{physical->string(), std::move(fingerprint)};
+        }
+    } catch (Error &) {
+    }
+    return std::nullopt;
+}
 
-    std::optional<SourcePath> file;
-    std::optional<Hash> hash;
+// Records a secret for the next evaluation to prefetch.
+static void noteResolved(
+    EvalState & state,
+    const std::optional<ManifestEntry> & entry,
+    Compression compression,
+    const StorePath & storePath,
+    const Hash & hash,
+    std::chrono::steady_clock::duration took)
+{
+    if (!entry)
+        return;
+    mini_agenix::recordResolved({
+        .file = entry->file,
+        .compression = compression == Compression::Zstd ? "zstd" : "none",
+        .hash = hash.to_string(HashFormat::SRI, true),
+        .storePath = state.store->printStorePath(storePath),
+        .fingerprint = entry->fingerprint,
+        .micros = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(took).count()),
+    });
+}
+
+// Checks a decryption against the expected hash and returns its store
+// path, adding the plaintext to the store unless it already is.
+static StorePath storeDecryption(
+    EvalState & state,
+    const PosIdx pos,
+    std::string_view who,
+    const SourcePath & encryptedFile,
+    const std::optional<Hash> & expectedHash,
+    const std::string & name,
+    FileIngestionMethod method,
+    const Decryption & decryption)
+{
+    checkActualHash(state, pos, who, encryptedFile, expectedHash, decryption.hash);
+
+    // Only needed if the evaluation that decrypted it expected another hash.
+    if (decryption.stored)
+        return lockedStorePath(*state.store, name, decryption.hash, method);
+    return addToStore(
+        *state.store, state.repair, name, decryption.content->view(), method, decryption.hash.algo);
+}
+
+static std::string ageStoreName(const SourcePath & encryptedFile, FileIngestionMethod method)
+{
+    auto name = secretName(encryptedFile);
+    if (method == FileIngestionMethod::NixArchive && name.ends_with(".nar"))
+        name.resize(name.size() - 4);
+    return name;
+}
+
+// Core logic shared by importAge, readAge and the tree primops.
+// Decrypts if necessary and ensures the result is in the store.
+// Returns the store path of the decrypted content. If the plaintext was
+// decrypted by this call, or by one it waited for, it is also returned
+// in `plaintext`, so that it does not have to be read back from the
+// store.
+static StorePath resolveAge(
+    EvalState & state,
+    const PosIdx pos,
+    std::string_view who,
+    const SourcePath & encryptedFile,
+    std::optional<Hash> expectedHash,
+    Compression compression,
+    FileIngestionMethod method = FileIngestionMethod::Flat,
+    std::shared_ptr<const mini_agenix::SecretBuffer> * plaintext = nullptr)
+{
+    auto started = std::chrono::steady_clock::now();
+    auto name = ageStoreName(encryptedFile, method);
+
+    checkExpectedHash(state, pos, who, expectedHash);
+    auto entry = manifestEntry(encryptedFile, expectedHash, method);
+    if (expectedHash) {
+        auto expectedPath = lockedStorePath(*state.store, name, *expectedHash, method);
+        if (ensureLockedPath(*state.store, expectedPath)) {
+            noteResolved(
+                state,
+                entry,
+                compression,
+                expectedPath,
+                *expectedHash,
+                std::chrono::steady_clock::now() - started);
+            return expectedPath;
+        }
+    }
+
+    auto ciphertext = readCiphertext(state, pos, who, encryptedFile);
+
+    std::optional<Decryption> decryption;
+    try {
+        decryption = decryptOnce(
+            *state.store, state.repair, name, encryptedFile, ciphertext, expectedHash, method, compression, nullptr);
+    } catch (...) {
+        rethrowDecryptError(state, pos, who, encryptedFile);
+    }
+
+    auto storePath = storeDecryption(state, pos, who, encryptedFile, expectedHash, name, method, *decryption);
+    if (plaintext)
+        *plaintext = decryption->content;
+    noteResolved(state, entry, compression, storePath, decryption->hash, std::chrono::steady_clock::now() - started);
+    return storePath;
+}
+
+// Plaintexts mounted in memory by importAge with `store = false`, by
+// SRI hash. Each plaintext keeps one SourcePath, so the evaluator's parse
+// and evaluation caches apply to it like to any other file.
+static Sync<std::map<std::string, SourcePath>> memorySources;
+
+// Like resolveAge, but leaves the store alone: the plaintext is returned
+// as a file in a MemorySourceAccessor. A hash-locked store path is still
+// used if it is already valid.
+static SourcePath resolveAgeInMemory(
+    EvalState & state,
+    const PosIdx pos,
+    std::string_view who,
+    const SourcePath & encryptedFile,
+    std::optional<Hash> expectedHash,
+    Compression compression)
+{
+    auto name = secretName(encryptedFile);
+
+    checkExpectedHash(state, pos, who, expectedHash);
+    if (expectedHash) {
+        auto expectedPath = lockedStorePath(*state.store, name, *expectedHash);
+        if (state.store->isValidPath(expectedPath)) {
+            state.allowPath(expectedPath);
+            return state.rootPath(CanonPath(state.store->printStorePath(expectedPath)));
+        }
+        auto memorySources_(memorySources.lock());
+        if (auto i = memorySources_->find(expectedHash->to_string(HashFormat::SRI, true)); i != memorySources_->end())
+            return i->second;
+    }
+
+    auto ciphertext = readCiphertext(state, pos, who, encryptedFile);
+
+    mini_agenix::SecretBuffer content;
+    Hash actualHash(HashAlgorithm::SHA256);
+    try {
+        std::tie(content, actualHash) = decryptAndHash(ciphertext, expectedHash, compression);
+    } catch (...) {
+        rethrowDecryptError(state, pos, who, encryptedFile);
+    }
+
+    checkActualHash(state, pos, who, encryptedFile, expectedHash, actualHash);
+
+    auto key = actualHash.to_string(HashFormat::SRI, true);
+    auto memorySources_(memorySources.lock());
+    if (auto i = memorySources_->find(key); i != memorySources_->end())
+        return i->second;
+
+    auto accessor = make_ref<MemorySourceAccessor>();
+    accessor->setPathDisplay(fmt("«decrypted %s»", encryptedFile));
+    // The accessor keeps its own copy, for as long as the evaluation runs.
+    auto path = accessor->addFile(CanonPath::root / name, std::string(content.view()));
+    memorySources_->emplace(key, path);
+    return path;
+}
+
+struct AgeAttrs {
+    SourcePath file;
+    std::optional<Hash> hash;
+    // importAge only: false to evaluate the plaintext from memory.
+    bool store = true;
+    Compression compression = Compression::None;
+};
+
+// Automatic prefetching, enabled with MINI_AGENIX_AUTO_PREFETCH=1. The
+// first time an age primop is called from a file, that file is parsed
+// again and searched for calls like
+//
+//   builtins.readAge { file = ./db-password.age; hash = "sha256-..."; }
+//
+// whose file is a path literal and whose hash is a string literal. Those
+// secrets are put in the store in the background, so that they are
+// usually there by the time evaluation forces them.
+//
+// Prefetching must not be observable other than in timing. Only
+// hash-locked secrets are prefetched, whose store path is the same
+// whoever adds it; only with keys that need no interaction (see
+// decryptSilently); and every error is dropped, as the primop call that
+// needs the secret reports its own.
+static bool autoPrefetch()
+{
+    static const bool enabled = getEnv("MINI_AGENIX_AUTO_PREFETCH") == "1";
+    return enabled;
+}
+
+// Runs prefetches on up to MINI_AGENIX_JOBS threads of its own. Work
+// that has not started when the process exits is dropped.
+class Prefetcher
+{
+public:
+    // Work is passed a flag that is set when the prefetcher stops, and
+    // should return soon after.
+    using Work = std::function<void(const std::atomic<bool> & stop)>;
+
+private:
+    struct State {
+        std::deque<Work> queue;
+        size_t idle = 0;
+        size_t running = 0;
+        bool quit = false;
+    };
+
+    // Shared with the threads, which may outlive the prefetcher.
+    struct Shared {
+        Sync<State> state;
+        std::condition_variable wakeup;
+        std::condition_variable exited;
+        std::atomic<bool> stop = false;
+    };
+
+    std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+    std::vector<std::thread> threads;
+
+    static void run(std::shared_ptr<Shared> shared)
+    {
+        while (true) {
+            Work work;
+            {
+                auto state(shared->state.lock());
+                ++state->idle;
+                while (!state->quit && state->queue.empty())
+                    state.wait(shared->wakeup);
+                --state->idle;
+                if (state->quit) {
+                    --state->running;
+                    shared->exited.notify_all();
+                    return;
+                }
+                work = std::move(state->queue.front());
+                state->queue.pop_front();
+            }
+            try {
+                work(shared->stop);
+            } catch (...) {
+            }
+        }
+    }
+
+public:
+    // Queued work is dropped, and work in progress is told to stop. Work
+    // stuck in something that cannot be interrupted, such as a store
+    // operation, is left behind after a grace period rather than holding
+    // up the exit.
+    ~Prefetcher()
+    {
+        shared->stop = true;
+        bool exited;
+        {
+            auto state(shared->state.lock());
+            state->quit = true;
+            state->queue.clear();
+            shared->wakeup.notify_all();
+            exited = state.wait_for(shared->exited, std::chrono::seconds(1), [&]() { return state->running == 0; });
+        }
+        for (auto & thread : threads)
+            if (exited)
+                thread.join();
+            else
+                thread.detach();
+    }
+
+    void enqueue(Work work)
+    {
+        auto state(shared->state.lock());
+        if (state->quit)
+            return;
+        state->queue.push_back(std::move(work));
+        if (state->idle == 0 && threads.size() < decryptionJobs()) {
+            ++state->running;
+            threads.emplace_back(run, shared);
+        } else
+            shared->wakeup.notify_one();
+    }
+};
+
+static Prefetcher & prefetcher()
+{
+    // What the threads use is never destroyed, so that threads left
+    // behind by the destructor can still finish.
+    static Prefetcher prefetcher;
+    return prefetcher;
+}
+
+// The primops whose argument names a secret that is stored as a file.
+static constexpr std::string_view secretReaders[] = {
+    "readAge", "readAgeJSON", "readAgeBase64", "readAgeTOML", "readAgeCBOR", "importAge"};
+
+// The secret read by `fun arg`, if it is a call to one of secretReaders
+// with nothing in its argument but a path literal `file`, a string literal
+// `hash` and optionally `compression`.
+static std::optional<AgeAttrs> literalSecret(const SymbolTable & symbols, Expr * fun, Expr * arg)
+{
+    auto isReader = [&](const auto & name) {
+        return std::ranges::any_of(secretReaders, [&](std::string_view reader) { return name == reader; });
+    };
+    if (auto var = dynamic_cast<ExprVar *>(fun)) {
+        if (!isReader(symbols[var->name]))
+            return std::nullopt;
+    } else if (auto select = dynamic_cast<ExprSelect *>(fun)) {
+        auto base = dynamic_cast<ExprVar *>(select->e);
+        if (!base || symbols[base->name] != "builtins" || select->def || select->attrPath.size() != 1
+            || !select->attrPath[0].symbol || !isReader(symbols[select->attrPath[0].symbol]))
+            return std::nullopt;
+    } else
+        return std::nullopt;
+
+    auto attrs = dynamic_cast<ExprAttrs *>(arg);
+    if (!attrs || attrs->recursive || !attrs->dynamicAttrs.empty())
+        return std::nullopt;
+
+    std::optional<SourcePath> file;
+    std::optional<Hash> hash;
+    auto compression = Compression::None;
+    for (auto & [attrName, def] : attrs->attrs) {
+        auto name = symbols[attrName];
+        auto path = dynamic_cast<ExprPath *>(def.e);
+        auto string = dynamic_cast<ExprString *>(def.e);
+        if (def.kind != ExprAttrs::AttrDef::Kind::Plain)
+            return std::nullopt;
+        if (name == "file" && path)
+            file = path->v.path();
+        else if (name == "hash" && string && !string->v.string_view().empty())
+            hash = newHashAllowEmpty(string->v.string_view(), HashAlgorithm::SHA256);
+        else if (name == "compression" && string && string->v.string_view() == "zstd")
+            compression = Compression::Zstd;
+        else if (name == "compression" && string && string->v.string_view() == "none")
+            continue;
+        else
+            // Anything else, such as importAge's `store`, is left to the call.
+            return std::nullopt;
+    }
+
+    if (!file || !hash)
+        return std::nullopt;
+    return AgeAttrs{std::move(*file), std::move(hash), true, compression};
+}
+
+// Searches the expressions that can hold a call to a secret reader in
+// the source of a module or secrets file: attribute sets, lists, calls,
+// functions, let, with and conditionals. Others, such as string
+// interpolations and arithmetic, are not searched.
+static void findLiteralSecrets(const SymbolTable & symbols, Expr * e, std::vector<AgeAttrs> & found)
+{
+    auto walk = [&](Expr * child) {
+        if (child)
+            findLiteralSecrets(symbols, child, found);
+    };
+
+    if (auto call = dynamic_cast<ExprCall *>(e)) {
+        if (!call->args.empty())
+            try {
+                if (auto secret = literalSecret(symbols, call->fun, call->args[0]))
+                    found.push_back(std::move(*secret));
+            } catch (Error &) {
+            }
+        walk(call->fun);
+        for (auto arg : call->args)
+            walk(arg);
+    } else if (auto attrs = dynamic_cast<ExprAttrs *>(e)) {
+        for (auto & [name, def] : attrs->attrs)
+            walk(def.e);
+        for (auto & def : attrs->dynamicAttrs) {
+            walk(def.nameExpr);
+            walk(def.valueExpr);
+        }
+    } else if (auto list = dynamic_cast<ExprList *>(e)) {
+        for (auto elem : list->elems)
+            walk(elem);
+    } else if (auto select = dynamic_cast<ExprSelect *>(e)) {
+        walk(select->e);
+        walk(select->def);
+    } else if (auto lambda = dynamic_cast<ExprLambda *>(e)) {
+        walk(lambda->body);
+    } else if (auto let = dynamic_cast<ExprLet *>(e)) {
+        walk(let->attrs);
+        walk(let->body);
+    } else if (auto with = dynamic_cast<ExprWith *>(e)) {
+        walk(with->attrs);
+        walk(with->body);
+    } else if (auto if_ = dynamic_cast<ExprIf *>(e)) {
+        walk(if_->cond);
+        walk(if_->then);
+        walk(if_->else_);
+    } else if (auto assert_ = dynamic_cast<ExprAssert *>(e)) {
+        walk(assert_->cond);
+        walk(assert_->body);
+    } else if (auto update = dynamic_cast<ExprOpUpdate *>(e)) {
+        walk(update->e1);
+        walk(update->e2);
+    } else if (auto concat = dynamic_cast<ExprConcatLists *>(e)) {
+        walk(concat->e1);
+        walk(concat->e2);
+    }
+}
+
+// Files already searched, and secrets already prefetched or read, by
+// file, hash and compression. The latter is never destroyed, as the
+// prefetch of the manifest adds to it (see loadIdentities).
+static Sync<std::set<std::string>> prefetchScanned;
+static auto & prefetchSeen = *new Sync<std::set<std::string>>;
+
+static std::string prefetchKey(const AgeAttrs & secret)
+{
+    return secret.file.to_string() + "\t" + (secret.hash ? secret.hash->to_string(HashFormat::SRI, true) : "") + "\t"
+           + (secret.compression == Compression::Zstd ? "zstd" : "none");
+}
+
+// Prefetches a hash-locked secret in the background, unless it has been
+// prefetched or read already.
+static void prefetchSecret(
+    ref<Store> store, RepairFlag repair, const AgeAttrs & secret, const std::filesystem::path & physical)
+{
+    if (!prefetchSeen.lock()->insert(prefetchKey(secret)).second)
+        return;
+
+    // Only the store is used, never the EvalState, which may be gone
+    // before the prefetch is.
+    // Nothing that can block for long: no substitution, which is left to
+    // the evaluation, and no waiting for locks (see BatchedSecret).
+    prefetcher().enqueue([store, repair, secret, physical](const std::atomic<bool> & stop) {
+        auto name = secretName(secret.file);
+        if (stop || store->isValidPath(lockedStorePath(*store, name, *secret.hash)))
+            return;
+        auto ciphertext = readFile(physical.string());
+        BatchedSecret batched{.speculative = &stop};
+        decryptOnce(
+            *store,
+            repair,
+            name,
+            secret.file,
+            ciphertext,
+            secret.hash,
+            FileIngestionMethod::Flat,
+            secret.compression,
+            &batched);
+    });
+}
+
+static void prefetchFromCaller(EvalState & state, const PosIdx pos)
+{
+    auto callerPos = state.positions[pos];
+    auto caller = std::get_if<SourcePath>(&callerPos.origin);
+    if (!caller || !prefetchScanned.lock()->insert(caller->to_string()).second)
+        return;
+
+    std::vector<AgeAttrs> secrets;
+    try {
+        findLiteralSecrets(state.symbols, state.parseExprFromFile(*caller), secrets);
+    } catch (Error & e) {
+        debug("not prefetching the secrets of '%s': %s", *caller, e.what());
+        return;
+    }
+
+    for (auto & secret : secrets) {
+        std::optional<std::filesystem::path> physical;
+        try {
+            physical = secret.file.getPhysicalPath();
+        } catch (Error &) {
+        }
+        if (physical)
+            prefetchSecret(state.store, state.repair, secret, *physical);
+    }
+}
+
+// Prefetches the hash-locked secrets previous evaluations resolved (see
+// manifest.hh), whose files are unchanged, the slowest first. The
+// manifest is read in the background too, so that the first age primop
+// call does not wait for it.
+static void prefetchFromManifest(EvalState & state)
+{
+    prefetcher().enqueue([store = state.store, repair = state.repair, rootFS = state.rootFS](
+                             const std::atomic<bool> & stop) {
+        for (auto & resolved : mini_agenix::loadResolved()) {
+            if (stop)
+                return;
+            try {
+                AgeAttrs secret{
+                    SourcePath(rootFS, CanonPath(resolved.file)),
+                    Hash::parseSRI(resolved.hash),
+                    true,
+                    resolved.compression == "zstd" ? Compression::Zstd : Compression::None,
+                };
+                auto storePath = lockedStorePath(*store, secretName(secret.file), *secret.hash);
+                if (store->printStorePath(storePath) == resolved.storePath)
+                    prefetchSecret(store, repair, secret, resolved.file);
+            } catch (Error &) {
+            }
+        }
+    });
+}
+
+// Called for every age primop call, with the call's own secret, which is
+// never prefetched.
+static void startPrefetching(EvalState & state, const PosIdx pos, const AgeAttrs & called)
+{
+    auto manifest = mini_agenix::resolvedManifest().has_value();
+    if (!autoPrefetch() && !manifest)
+        return;
+    prefetchSeen.lock()->insert(prefetchKey(called));
 
-    for (auto & attr : *args[0]->attrs()) {
+    static std::once_flag manifestPrefetched;
+    if (manifest)
+        std::call_once(manifestPrefetched, [&]() { prefetchFromManifest(state); });
+    if (autoPrefetch())
+        prefetchFromCaller(state, pos);
+}
+
+// extraAttrs are left for the caller to parse.
+static AgeAttrs parseAgeAttrs(
+    EvalState & state,
+    const PosIdx pos,
+    Value & arg,
+    std::string_view who,
+    bool allowStore = false,
+    std::initializer_list<std::string_view> extraAttrs = {})
+{
+    state.forceAttrs(arg, pos, fmt("while evaluating the argument passed to '%s'", who));
+
+    std::optional<SourcePath> file;
+    std::optional<Hash> hash;
+    bool store = true;
+    auto compression = Compression::None;
+
+    for (auto & attr : *arg.attrs()) {
         auto attrName = state.symbols[attr.name];
         if (attrName == "file") {
             NixStringContext ctx;
@@ -236,6 +1509,20 @@ static AgeAttrs parseAgeAttrs(EvalState & state, const PosIdx pos, Value ** args
                 *attr.value, attr.pos, fmt("while evaluating the 'hash' attribute passed to '%s'", who));
             if (!s.empty())
                 hash = newHashAllowEmpty(s, HashAlgorithm::SHA256);
+        } else if (attrName == "store" && allowStore) {
+            store = state.forceBool(
+                *attr.value, attr.pos, fmt("while evaluating the 'store' attribute passed to '%s'", who));
+        } else if (std::ranges::any_of(extraAttrs, [&](std::string_view extra) { return attrName == extra; })) {
+            continue;
+        } else if (attrName == "compression") {
+            auto s = state.forceStringNoCtx(
+                *attr.value, attr.pos, fmt("while evaluating the 'compression' attribute passed to '%s'", who));
+            if (s == "zstd")
+                compression = Compression::Zstd;
+            else if (s != "none")
+                state.error<EvalError>("unsupported compression '%s' in '%s'; expected \"zstd\" or \"none\"", s, who)
+                    .atPos(attr.pos)
+                    .debugThrow();
         } else {
             state.error<EvalError>("unsupported attribute '%s' in '%s'", attrName, who)
                 .atPos(attr.pos)
@@ -246,16 +1533,24 @@ static AgeAttrs parseAgeAttrs(EvalState & state, const PosIdx pos, Value ** args
     if (!file)
         state.error<EvalError>("'file' attribute is required in '%s'", who).atPos(pos).debugThrow();
 
-    return {std::move(*file), std::move(hash)};
+    AgeAttrs attrs{std::move(*file), std::move(hash), store, compression};
+    startPrefetching(state, pos, attrs);
+    return attrs;
 }
 
 static void prim_importAge(EvalState & state, const PosIdx pos, Value ** args, Value & v)
 {
-    auto [file, hash] = parseAgeAttrs(state, pos, args, "builtins.importAge");
-    auto storePath = resolveAge(state, pos, "builtins.importAge", file, hash);
-    state.allowPath(storePath);
+    std::string_view who = "builtins.importAge";
+    auto attrs = parseAgeAttrs(state, pos, *args[0], who, true);
+
+    auto sourcePath = [&]() {
+        if (!attrs.store)
+            return resolveAgeInMemory(state, pos, who, attrs.file, attrs.hash, attrs.compression);
+        auto storePath = resolveAge(state, pos, who, attrs.file, attrs.hash, attrs.compression);
+        state.allowPath(storePath);
+        return state.rootPath(CanonPath(state.store->printStorePath(storePath)));
+    }();
 
-    auto sourcePath = state.rootPath(CanonPath(state.store->printStorePath(storePath)));
     try {
         state.evalFile(sourcePath, v);
     } catch (Error & e) {
@@ -264,22 +1559,717 @@ static void prim_importAge(EvalState & state, const PosIdx pos, Value ** args, V
     }
 }
 
-static void prim_readAge(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+// The plaintext of a secret, for the primops that turn it into a value:
+// as this evaluation decrypted it, or else mapped from its store path.
+// Either way, the only copy made of it is the one into the Nix value.
+struct Plaintext {
+    std::shared_ptr<const mini_agenix::SecretBuffer> decrypted;
+    std::unique_ptr<MappedFile> stored;
+
+    std::string_view view() const
+    {
+        return decrypted ? decrypted->view() : stored->view();
+    }
+};
+
+static Plaintext readPlaintext(EvalState & state, const PosIdx pos, std::string_view who, const AgeAttrs & attrs)
 {
-    auto [file, hash] = parseAgeAttrs(state, pos, args, "builtins.readAge");
-    auto storePath = resolveAge(state, pos, "builtins.readAge", file, hash);
+    Plaintext plaintext;
+    auto storePath = resolveAge(
+        state,
+        pos,
+        who,
+        attrs.file,
+        attrs.hash,
+        attrs.compression,
+        FileIngestionMethod::Flat,
+        &plaintext.decrypted);
     state.allowPath(storePath);
+    if (!plaintext.decrypted)
+        plaintext.stored = std::make_unique<MappedFile>(std::filesystem::path(state.store->printStorePath(storePath)));
+    return plaintext;
+}
 
-    auto content = nix::readFile(state.store->printStorePath(storePath));
+static void prim_readAge(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    auto attrs = parseAgeAttrs(state, pos, *args[0], "builtins.readAge");
+    auto plaintext = readPlaintext(state, pos, "builtins.readAge", attrs);
+    auto content = plaintext.view();
+    if (content.find('\0') != std::string_view::npos)
+        state
+            .error<EvalError>(
+                "builtins.readAge: the decrypted contents of '%s' cannot be represented as a Nix string", attrs.file)
+            .atPos(pos)
+            .debugThrow();
+    v.mkString(content, state.mem);
+}
+
+static void prim_readAgeJSON(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    auto attrs = parseAgeAttrs(state, pos, *args[0], "builtins.readAgeJSON");
+    auto plaintext = readPlaintext(state, pos, "builtins.readAgeJSON", attrs);
+    auto content = plaintext.view();
+    try {
+        parseJSON(state, content, v);
+    } catch (JSONParseError & e) {
+        e.addTrace(state.positions[pos], "while decoding the decrypted contents of '%s' as JSON", attrs.file);
+        throw;
+    }
+}
+
+// Binary secrets, which readAge cannot return, as base64.
+static void prim_readAgeBase64(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    auto attrs = parseAgeAttrs(state, pos, *args[0], "builtins.readAgeBase64");
+    auto plaintext = readPlaintext(state, pos, "builtins.readAgeBase64", attrs);
+    auto content = plaintext.view();
+    std::string encoded(mini_agenix::base64EncodedSize(content.size()), '\0');
+    mini_agenix::base64EncodeInto(content, encoded.data());
+    v.mkString(encoded, state.mem);
+}
+
+static void prim_readAgeRange(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    std::string_view who = "builtins.readAgeRange";
+    auto attrs = parseAgeAttrs(state, pos, *args[0], who, false, {"offset", "length"});
+    if (attrs.compression != Compression::None)
+        state.error<EvalError>("%s does not support compressed secrets", who).atPos(pos).debugThrow();
+
+    auto rangeAttr = [&](std::string_view name) -> uint64_t {
+        auto attr = args[0]->attrs()->get(state.symbols.create(name));
+        if (!attr)
+            state.error<EvalError>("'%s' attribute is required in '%s'", name, who).atPos(pos).debugThrow();
+        auto n = state.forceInt(
+            *attr->value, attr->pos, fmt("while evaluating the '%s' attribute passed to '%s'", name, who));
+        if (n.value < 0)
+            state.error<EvalError>("'%s' passed to '%s' must not be negative", name, who)
+                .atPos(attr->pos)
+                .debugThrow();
+        return n.value;
+    };
+    auto offset = rangeAttr("offset");
+    auto length = rangeAttr("length");
+
+    // Ranges are not added to the store: the hash only pins the bytes read.
+    checkExpectedHash(state, pos, who, attrs.hash);
+    checkCiphertextExists(state, pos, who, attrs.file);
+    MappedFile ciphertext(attrs.file);
+
+    std::string content;
+    try {
+        content = decryptRange(ciphertext.view(), offset, length);
+    } catch (...) {
+        rethrowDecryptError(state, pos, who, attrs.file);
+    }
+
+    checkActualHash(state, pos, who, attrs.file, attrs.hash, hashString(plaintextHashAlgo(attrs.hash), content));
     if (content.find('\0') != std::string::npos)
         state
             .error<EvalError>(
-                "builtins.readAge: the decrypted contents of '%s' cannot be represented as a Nix string", file)
+                "%s: the decrypted range of '%s' cannot be represented as a Nix string", who, attrs.file)
             .atPos(pos)
             .debugThrow();
     v.mkString(content, state.mem);
 }
 
+// Nix does not export its TOML parser, so the plaintext is handed to the
+// fromTOML builtin directly.
+static void prim_readAgeTOML(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    auto attrs = parseAgeAttrs(state, pos, *args[0], "builtins.readAgeTOML");
+    auto plaintext = readPlaintext(state, pos, "builtins.readAgeTOML", attrs);
+    auto content = plaintext.view();
+    auto arg = state.allocValue();
+    arg->mkString(content, state.mem);
+    try {
+        state.callFunction(state.getBuiltin("fromTOML"), *arg, v, pos);
+    } catch (Error & e) {
+        e.addTrace(state.positions[pos], "while decoding the decrypted contents of '%s' as TOML", attrs.file);
+        throw;
+    }
+}
+
+static void prim_readAgeCBOR(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    auto attrs = parseAgeAttrs(state, pos, *args[0], "builtins.readAgeCBOR");
+    auto plaintext = readPlaintext(state, pos, "builtins.readAgeCBOR", attrs);
+    auto content = plaintext.view();
+    try {
+        mini_agenix::parseCBOR(state, content, v);
+    } catch (mini_agenix::CBORError & e) {
+        state
+            .error<EvalError>(
+                "builtins.readAgeCBOR: cannot decode the decrypted contents of '%s': %s",
+                attrs.file,
+                e.info().msg.str())
+            .atPos(pos)
+            .debugThrow();
+    }
+}
+
+// The plaintext of an encrypted tree is a NAR, as written by
+// `nix-store --dump`, and is added to the store as one store path.
+static StorePath resolveAgeTree(EvalState & state, const PosIdx pos, std::string_view who, const AgeAttrs & attrs)
+{
+    try {
+        return resolveAge(
+            state, pos, who, attrs.file, attrs.hash, attrs.compression, FileIngestionMethod::NixArchive);
+    } catch (Error & e) {
+        e.addTrace(state.positions[pos], "while decrypting the tree '%s'", attrs.file);
+        throw;
+    }
+}
+
+static void prim_importAgeTree(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    std::string_view who = "builtins.importAgeTree";
+    auto attrs = parseAgeAttrs(state, pos, *args[0], who);
+    auto storePath = resolveAgeTree(state, pos, who, attrs);
+    state.allowPath(storePath);
+
+    // Files in the tree are evaluated from the store path, so they can
+    // import each other by relative paths.
+    auto root = state.rootPath(CanonPath(state.store->printStorePath(storePath)));
+    try {
+        state.evalFile(resolveExprPath(root), v);
+    } catch (Error & e) {
+        e.addTrace(state.positions[pos], "while evaluating the decrypted tree from 'builtins.importAgeTree'");
+        throw;
+    }
+}
+
+static void prim_readAgeTree(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    std::string_view who = "builtins.readAgeTree";
+    auto attrs = parseAgeAttrs(state, pos, *args[0], who);
+    state.allowAndSetStorePathString(resolveAgeTree(state, pos, who, attrs), v);
+}
+
+// Secrets this process has added to the pending manifest, so that each is
+// appended once however often it is referenced.
+static Sync<std::set<std::string>> pendingRecorded;
+
+// The store path a secret will have once it is decrypted, computed from
+// its hash alone: neither the file nor the store is looked at. The secret
+// is added to the pending manifest for mini-agenix-realise.
+static void prim_ageLockedPath(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    std::string_view who = "builtins.ageLockedPath";
+    auto attrs = parseAgeAttrs(state, pos, *args[0], who);
+    if (!attrs.hash)
+        state.error<EvalError>("%s: the 'hash' attribute is required", who).atPos(pos).debugThrow();
+    checkExpectedHash(state, pos, who, attrs.hash);
+
+    auto storePath = lockedStorePath(*state.store, secretName(attrs.file), *attrs.hash);
+
+    auto physical = attrs.file.getPhysicalPath();
+    if (!physical)
+        warn(
+            "%s: '%s' is not a file on disk, so mini-agenix-realise cannot decrypt it; "
+            "use builtins.prefetchAge instead",
+            who,
+            attrs.file);
+    else if (pendingRecorded.lock()->insert(state.store->printStorePath(storePath)).second) {
+        try {
+            mini_agenix::appendPending({
+                .file = physical->string(),
+                .hash = attrs.hash->to_string(HashFormat::SRI, true),
+                .compression = attrs.compression == Compression::Zstd ? "zstd" : "none",
+            });
+        } catch (Error & e) {
+            warn("%s: cannot record '%s' for mini-agenix-realise: %s", who, attrs.file, e.info().msg.str());
+        }
+    }
+
+    state.allowAndSetStorePathString(storePath, v);
+}
+
+// A bundle opened by importAgeBundle. Its file key is unwrapped once, and
+// entries are decrypted, a few chunks at a time, when they are read.
+struct AgeBundle {
+    std::string ciphertext;
+    size_t payloadOffset = 0;
+    OpenedSecret opened;
+    mini_agenix::BundleIndex index;
+
+    std::string read(uint64_t offset, uint64_t length) const
+    {
+        if (auto plaintext = std::get_if<std::string>(&opened))
+            return plaintext->substr(offset, length);
+        return mini_agenix::decryptPayloadRange(
+            std::get<mini_agenix::FileKey>(opened),
+            std::string_view(ciphertext).substr(payloadOffset),
+            offset,
+            length);
+    }
+
+    uint64_t size() const
+    {
+        if (auto plaintext = std::get_if<std::string>(&opened))
+            return plaintext->size();
+        return mini_agenix::payloadSize(std::string_view(ciphertext).substr(payloadOffset));
+    }
+
+    ~AgeBundle()
+    {
+        std::visit([](auto & secret) { OPENSSL_cleanse(secret.data(), secret.size()); }, opened);
+    }
+};
+
+// Bundles opened by this process, by ciphertext hash. Never destroyed
+// (see loadIdentities).
+static auto & openBundles = *new Sync<std::map<std::string, std::shared_ptr<const AgeBundle>>>;
+
+static std::shared_ptr<const AgeBundle> openBundle(std::string ciphertext)
+{
+    auto ciphertextHash = hashString(HashAlgorithm::SHA256, ciphertext).to_string(HashFormat::Base16, false);
+    if (auto openBundles_(openBundles.lock()); openBundles_->count(ciphertextHash))
+        return openBundles_->at(ciphertextHash);
+
+    // Entries are decrypted a few chunks at a time, which needs random
+    // access to the binary file.
+    if (auto armored = mini_agenix::parseArmor(ciphertext))
+        ciphertext = mini_agenix::dearmor(*armored);
+
+    auto bundle = std::make_shared<AgeBundle>();
+    bundle->ciphertext = std::move(ciphertext);
+    {
+        decryptionSlots().acquire();
+        Finally release([]() { decryptionSlots().release(); });
+        ParsedSecret secret(bundle->ciphertext);
+        if (secret.header)
+            bundle->payloadOffset = secret.header->payloadOffset;
+        bundle->opened = openSecret(secret, false);
+    }
+    bundle->index = mini_agenix::readBundleIndex(
+        bundle->size(), [&](uint64_t offset, uint64_t length) { return bundle->read(offset, length); });
+
+    return openBundles.lock()->emplace(ciphertextHash, bundle).first->second;
+}
+
+static void prim_importAgeBundle(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    std::string_view who = "builtins.importAgeBundle";
+    auto attrs = parseAgeAttrs(state, pos, *args[0], who);
+    // Entries are read at their offsets in the plaintext, which a
+    // compressed stream does not have.
+    if (attrs.compression != Compression::None)
+        state.error<EvalError>("%s does not support compressed bundles", who).atPos(pos).debugThrow();
+
+    checkExpectedHash(state, pos, who, attrs.hash);
+    auto ciphertext = readCiphertext(state, pos, who, attrs.file);
+
+    std::shared_ptr<const AgeBundle> bundle;
+    try {
+        bundle = openBundle(std::move(ciphertext));
+    } catch (mini_agenix::BundleError & e) {
+        state.error<EvalError>("%s: '%s' is not a valid bundle: %s", who, attrs.file, e.info().msg.str())
+            .atPos(pos)
+            .debugThrow();
+    } catch (...) {
+        rethrowDecryptError(state, pos, who, attrs.file);
+    }
+
+    checkActualHash(
+        state, pos, who, attrs.file, attrs.hash, hashString(plaintextHashAlgo(attrs.hash), bundle->index.text));
+
+    // Each attribute is an application of this function to the entry's
+    // name, so nothing is decrypted until the attribute is forced.
+    auto readEntry = state.allocValue();
+    readEntry->mkPrimOp(new PrimOp{
+        .name = "readAgeBundleEntry",
+        .args = {"name"},
+        .arity = 1,
+        .impl = [bundle, file = attrs.file, pos, who](EvalState & state, const PosIdx, Value ** args, Value & v) {
+            auto name = std::string(state.forceStringNoCtx(*args[0], pos, "while reading a bundle entry"));
+            auto & entry = bundle->index.entries.at(name);
+
+            std::string content;
+            try {
+                content = bundle->read(entry.offset, entry.length);
+            } catch (mini_agenix::AgeError & e) {
+                state
+                    .error<EvalError>(
+                        "%s: failed to decrypt entry '%s' of '%s': %s", who, name, file, e.info().msg.str())
+                    .atPos(pos)
+                    .debugThrow();
+            }
+
+            if (hashString(HashAlgorithm::SHA256, content).to_string(HashFormat::Base16, false) != entry.sha256)
+                state.error<EvalError>("%s: entry '%s' of '%s' does not match its hash", who, name, file)
+                    .atPos(pos)
+                    .debugThrow();
+            if (content.find('\0') != std::string::npos)
+                state
+                    .error<EvalError>(
+                        "%s: entry '%s' of '%s' cannot be represented as a Nix string", who, name, file)
+                    .atPos(pos)
+                    .debugThrow();
+            v.mkString(content, state.mem);
+        },
+    });
+
+    auto entries = state.buildBindings(bundle->index.entries.size());
+    for (auto & [name, entry] : bundle->index.entries) {
+        auto nameValue = state.allocValue();
+        nameValue->mkString(name, state.mem);
+        entries.alloc(state.symbols.create(name)).mkApp(readEntry, nameValue);
+    }
+    v.mkAttrs(entries);
+}
+
+// Unwraps, for a batch of secrets, the file keys that only age plugins
+// can unwrap, in one session per plugin. Errors are left for the
+// individual decryptions to report.
+static void prefetchPluginFileKeys(
+    Store & store,
+    const std::vector<AgeAttrs> & secrets,
+    const std::vector<std::string> & names,
+    const std::vector<std::optional<BatchedSecret>> & batch)
+{
+    auto identities = loadIdentities(discoverIdentities().usable);
+    if (identities.plugins.empty())
+        return;
+
+    std::deque<ParsedSecret> parsed;
+    PendingHeaders pending;
+
+    for (size_t i = 0; i < secrets.size(); ++i) {
+        if (!batch[i])
+            continue;
+        try {
+            // Decrypted by another evaluation, which decryptOnce checks
+            // again under the lock.
+            auto & [file, hash, store_, compression] = secrets[i];
+            auto record = decryptionRecord(batch[i]->ciphertextHash + variantSuffix(hash, compression));
+            if (record && recordedDecryption(store, *record, names[i], hash, FileIngestionMethod::Flat))
+                continue;
+            auto & secret = parsed.emplace_back(batch[i]->ciphertext);
+            if (!secret.header || mini_agenix::unwrapFileKey(*secret.header, identities.identities))
+                continue;
+            pending.emplace_back(headerKey(secret.headerBytes()), &*secret.header);
+        } catch (Error &) {
+        }
+    }
+
+    try {
+        unwrapWithPlugins(identities, pending);
+    } catch (Error &) {
+    }
+}
+
+// Reads the ciphertexts of the given secrets of a prefetchAge list, many
+// at a time (see batchread.hh). Files that cannot be read are left for
+// the caller to report.
+static std::vector<std::optional<std::string>>
+readCiphertexts(const std::vector<AgeAttrs> & secrets, const std::vector<size_t> & which)
+{
+    std::vector<std::optional<std::string>> ciphertexts(secrets.size());
+    std::vector<size_t> indices;
+    std::vector<std::filesystem::path> paths;
+
+    for (auto i : which) {
+        auto & file = secrets[i].file;
+        try {
+            if (auto physical = file.getPhysicalPath()) {
+                indices.push_back(i);
+                paths.push_back(*physical);
+            } else
+                ciphertexts[i] = file.readFile();
+        } catch (Error &) {
+        }
+    }
+
+    auto contents = mini_agenix::readFiles(paths, mini_agenix::ioDepth());
+    for (size_t j = 0; j < indices.size(); ++j)
+        ciphertexts[indices[j]] = std::move(contents[j]);
+    return ciphertexts;
+}
+
+// Hands the ciphertexts read ahead to decryptOnce, hashed, so that the
+// batch can look up decryptions recorded by other evaluations. Nothing is
+// decrypted here: decryptOnce only decrypts once it holds the lock on the
+// secret and has found no decryption recorded by another evaluation.
+static std::vector<std::optional<BatchedSecret>> hashCiphertexts(std::vector<std::optional<std::string>> && read)
+{
+    std::vector<std::optional<BatchedSecret>> batch(read.size());
+    for (size_t i = 0; i < read.size(); ++i)
+        if (read[i]) {
+            auto ciphertextHash = hashString(HashAlgorithm::SHA256, *read[i]).to_string(HashFormat::Base16, false);
+            batch[i] = BatchedSecret{.ciphertext = std::move(*read[i]), .ciphertextHash = std::move(ciphertextHash)};
+        }
+    return batch;
+}
+
+static void prim_prefetchAge(EvalState & state, const PosIdx pos, Value ** args, Value & v)
+{
+    std::string_view who = "builtins.prefetchAge";
+    state.forceList(*args[0], pos, "while evaluating the argument passed to 'builtins.prefetchAge'");
+
+    std::vector<AgeAttrs> secrets;
+    for (auto elem : args[0]->listView())
+        secrets.push_back(parseAgeAttrs(state, pos, *elem, who));
+
+    // Everything that needs the EvalState, or reports an error, happens
+    // on this thread, in the order of the list; the workers only decrypt.
+    std::vector<std::string> names(secrets.size());
+    std::vector<std::optional<ManifestEntry>> entries(secrets.size());
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < secrets.size(); ++i) {
+        auto started = std::chrono::steady_clock::now();
+        auto & [file, hash, store, compression] = secrets[i];
+        names[i] = ageStoreName(file, FileIngestionMethod::Flat);
+        checkExpectedHash(state, pos, who, hash);
+        entries[i] = manifestEntry(file, hash, FileIngestionMethod::Flat);
+        if (hash) {
+            auto path = lockedStorePath(*state.store, names[i], *hash);
+            if (ensureLockedPath(*state.store, path)) {
+                noteResolved(
+                    state,
+                    entries[i],
+                    compression,
+                    path,
+                    *hash,
+                    std::chrono::steady_clock::now() - started);
+                continue;
+            }
+        }
+        pending.push_back(i);
+    }
+
+    auto ciphertexts = readCiphertexts(secrets, pending);
+    for (auto i : pending)
+        if (!ciphertexts[i])
+            ciphertexts[i] = readCiphertext(state, pos, who, secrets[i].file);
+    auto batch = hashCiphertexts(std::move(ciphertexts));
+    auto & store = *state.store;
+    prefetchPluginFileKeys(store, secrets, names, batch);
+
+    auto repair = state.repair;
+    std::vector<std::optional<Decryption>> decryptions(secrets.size());
+    std::vector<std::exception_ptr> errors(secrets.size());
+    std::vector<std::chrono::steady_clock::duration> took(secrets.size());
+    ThreadPool pool(std::min<size_t>(decryptionJobs(), pending.size()));
+    for (auto i : pending)
+        pool.enqueue([&, i]() {
+            auto started = std::chrono::steady_clock::now();
+            auto & [file, hash, store_, compression] = secrets[i];
+            try {
+                decryptions[i] = decryptOnce(
+                    store,
+                    repair,
+                    names[i],
+                    file,
+                    batch[i]->ciphertext,
+                    hash,
+                    FileIngestionMethod::Flat,
+                    compression,
+                    &*batch[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+            took[i] = std::chrono::steady_clock::now() - started;
+        });
+    pool.process();
+
+    for (auto i : pending) {
+        auto & [file, hash, store_, compression] = secrets[i];
+        if (errors[i])
+            try {
+                std::rethrow_exception(errors[i]);
+            } catch (...) {
+                rethrowDecryptError(state, pos, who, file);
+            }
+        auto path = storeDecryption(state, pos, who, file, hash, names[i], FileIngestionMethod::Flat, *decryptions[i]);
+        noteResolved(state, entries[i], compression, path, decryptions[i]->hash, took[i]);
+    }
+
+    v.mkNull();
+}
+
+// Flake inputs that are age-encrypted files or trees:
+//
+//   inputs.db-password = { url = "age+file:///etc/secrets/db-password.age"; flake = false; };
+//   inputs.certs = { url = "age+file:///etc/secrets/certs.nar.age?tree=1"; flake = false; };
+//
+// The plaintext is added to the store, as a file or, with `tree`, as the
+// file system object its NAR describes, and flake.lock records its NAR
+// hash. From then on the store path is found by that hash, or
+// substituted, and the file is only decrypted again if neither works.
+// Paths must be absolute: a relative path input is read from the
+// flake's own source tree, which would bypass the decryption.
+struct AgeInputScheme : fetchers::InputScheme
+{
+    std::optional<fetchers::Input>
+    inputFromURL(const fetchers::Settings & settings, const ParsedURL & url, bool requireTree) const override
+    {
+        if (url.scheme != "age+file")
+            return std::nullopt;
+
+        fetchers::Attrs attrs{{"type", "age"}, {"path", url.path}};
+        for (auto & [name, value] : url.query)
+            if (name == "tree")
+                attrs.emplace(name, Explicit<bool>{value == "1" || value == "true"});
+            else
+                attrs.emplace(name, value);
+        return inputFromAttrs(settings, attrs);
+    }
+
+    std::string_view schemeName() const override
+    {
+        return "age";
+    }
+
+    StringSet allowedAttrs() const override
+    {
+        return {"path", "tree", "compression", "narHash"};
+    }
+
+    std::optional<fetchers::Input>
+    inputFromAttrs(const fetchers::Settings & settings, const fetchers::Attrs & attrs) const override
+    {
+        auto path = fetchers::getStrAttr(attrs, "path");
+        if (!isAbsolute(path))
+            throw Error("the path '%s' of an age input must be absolute", path);
+        if (auto compression = fetchers::maybeGetStrAttr(attrs, "compression");
+            compression && *compression != "zstd" && *compression != "none")
+            throw Error("unsupported compression '%s' in age input; expected \"zstd\" or \"none\"", *compression);
+
+        fetchers::Input input{settings};
+        input.attrs = attrs;
+        return input;
+    }
+
+    ParsedURL toURL(const fetchers::Input & input) const override
+    {
+        auto query = fetchers::attrsToQuery(input.attrs);
+        query.erase("type");
+        query.erase("path");
+        return ParsedURL{
+            .scheme = "age+file",
+            .path = fetchers::getStrAttr(input.attrs, "path"),
+            .query = query,
+        };
+    }
+
+    bool isLocked(const fetchers::Input & input) const override
+    {
+        return input.getNarHash().has_value();
+    }
+
+    std::optional<std::string> getFingerprint(ref<Store> store, const fetchers::Input & input) const override
+    {
+        if (auto narHash = input.getNarHash())
+            return narHash->to_string(HashFormat::SRI, true);
+        return std::nullopt;
+    }
+
+    std::pair<ref<SourceAccessor>, fetchers::Input>
+    getAccessor(ref<Store> store, const fetchers::Input & input) const override
+    {
+        auto path = fetchers::getStrAttr(input.attrs, "path");
+        auto narHash = input.getNarHash();
+
+        auto accessor = [&](const StorePath & storePath) {
+            auto accessor = makeStorePathAccessor(store, storePath);
+            accessor->setPathDisplay("«" + input.to_string() + "»");
+            return accessor;
+        };
+
+        if (narHash) {
+            auto storePath = store->makeFixedOutputPath(
+                input.getName(),
+                FixedOutputInfo{
+                    .method = FileIngestionMethod::NixArchive,
+                    .hash = *narHash,
+                    .references = {},
+                });
+            try {
+                store->ensurePath(storePath);
+                return {accessor(storePath), input};
+            } catch (Error & e) {
+                debug("decrypting '%s', as its store path is unavailable: %s", path, e.what());
+            }
+        }
+
+        auto compression = fetchers::maybeGetStrAttr(input.attrs, "compression") == "zstd" ? Compression::Zstd
+                                                                                            : Compression::None;
+        auto tree = fetchers::maybeGetBoolAttr(input.attrs, "tree").value_or(false);
+
+        auto lock = [&](const StorePath & storePath, const Hash & actualNarHash) {
+            if (narHash && actualNarHash != *narHash)
+                throw Error(
+                    "NAR hash mismatch in age input '%s':\n  specified: %s\n  got:       %s",
+                    input.to_string(),
+                    narHash->to_string(HashFormat::SRI, true),
+                    actualNarHash.to_string(HashFormat::SRI, true));
+            auto locked = input;
+            locked.attrs.insert_or_assign("narHash", actualNarHash.to_string(HashFormat::SRI, true));
+            return std::pair{accessor(storePath), std::move(locked)};
+        };
+
+        std::string ciphertext;
+        try {
+            ciphertext = readFile(path);
+        } catch (Error & e) {
+            throw Error("cannot read the age input '%s': %s", input.to_string(), e.info().msg.str());
+        }
+
+        // Keyed by the attributes locked to the ciphertext, so that an
+        // unchanged file is decrypted again only once its store path is
+        // gone, whether or not flake.lock records its NAR hash yet.
+        auto cache = input.settings->getCache();
+        fetchers::Cache::Key cacheKey{
+            "age",
+            {
+                {"path", path},
+                {"tree", Explicit<bool>{tree}},
+                {"compression", compression == Compression::Zstd ? "zstd" : "none"},
+                {"ciphertextHash", hashString(HashAlgorithm::SHA256, ciphertext).to_string(HashFormat::Base16, false)},
+            }};
+        if (auto cached = cache->lookupStorePath(cacheKey, *store))
+            return lock(cached->storePath, Hash::parseSRI(fetchers::getStrAttr(cached->value, "narHash")));
+
+        mini_agenix::SecretBuffer plaintext;
+        Hash hash(HashAlgorithm::SHA256);
+        try {
+            std::tie(plaintext, hash) = decryptAndHash(ciphertext, std::nullopt, compression);
+        } catch (Error & e) {
+            throw Error("failed to decrypt the age input '%s': %s", input.to_string(), e.info().msg.str());
+        }
+
+        // A tree is checked like the plaintext of importAgeTree: its NAR
+        // hash is the hash of the whole plaintext. A file is stored
+        // recursively, as every input is, so its NAR hash is computed.
+        std::optional<StorePath> storePath;
+        Hash actualNarHash = hash;
+        if (tree)
+            storePath = addDecryptedToStore(
+                *store,
+                NoRepair,
+                input.getName(),
+                plaintext.view(),
+                hash,
+                FileIngestionMethod::NixArchive,
+                fmt("the age input '%s'", input.to_string()));
+        else {
+            StringSource source(plaintext.view());
+            storePath = store->addToStoreFromDump(
+                source,
+                input.getName(),
+                FileSerialisationMethod::Flat,
+                ContentAddressMethod::Raw::NixArchive,
+                HashAlgorithm::SHA256);
+            actualNarHash = store->queryPathInfo(*storePath)->narHash;
+        }
+
+        cache->upsert(cacheKey, *store, {{"narHash", actualNarHash.to_string(HashFormat::SRI, true)}}, *storePath);
+        return lock(*storePath, actualNarHash);
+    }
+};
+
+static auto rAgeInputScheme = OnStartup([] { fetchers::registerInputScheme(std::make_unique<AgeInputScheme>()); });
+
 static RegisterPrimOp primop_importAge({
     .name = "importAge",
     .args = {"attrs"},
@@ -289,7 +2279,15 @@ static RegisterPrimOp primop_importAge({
       *attrs* is an attribute set with the following attributes:
 
       - `file` (path, required): Path to the age-encrypted file.
-      - `hash` (string, optional): SRI hash (SHA-256) of the decrypted content.
+      - `hash` (string, optional): SRI hash of the decrypted content, as for
+        `builtins.readAge`.
+      - `store` (bool, optional, default `true`): If `false`, the decrypted
+        file is evaluated from memory and never written to the store. It
+        cannot import paths relative to itself.
+      - `compression` (string, optional, default `"none"`): `"zstd"` if
+        the plaintext was compressed before encryption, e.g.
+        `zstd -c secret | age -r ... -o secret.age`. It is decompressed
+        when decrypted, and `hash` is that of the decompressed contents.
 
       When `hash` is provided and the corresponding store path exists,
       the result is returned from cache with no decryption or identity needed,
@@ -308,6 +2306,13 @@ static RegisterPrimOp primop_readAge({
 
       - `file` (path, required): Path to the age-encrypted file.
       - `hash` (string, optional): SRI hash (SHA-256) of the decrypted content.
+        A BLAKE3 hash (`blake3-...`, with the `blake3-hashes` experimental
+        feature) is checked faster on large secrets and gives a store path
+        addressed by it.
+      - `compression` (string, optional, default `"none"`): `"zstd"` if
+        the plaintext was compressed before encryption, e.g.
+        `zstd -c secret | age -r ... -o secret.age`. It is decompressed
+        when decrypted, and `hash` is that of the decompressed contents.
 
       When `hash` is provided and the corresponding store path exists,
       the result is returned from cache with no decryption or identity needed,
@@ -315,3 +2320,211 @@ static RegisterPrimOp primop_readAge({
     )",
     .impl = prim_readAge,
 });
+
+static RegisterPrimOp primop_readAgeBase64({
+    .name = "readAgeBase64",
+    .args = {"attrs"},
+    .doc = R"(
+      Decrypt an age-encrypted file and return its contents base64-encoded
+      (RFC 4648, with padding). Unlike `builtins.readAge`, this works for
+      any plaintext, including binary data with NUL bytes.
+
+      *attrs* is an attribute set as accepted by `builtins.readAge`; `hash`
+      is the hash of the decrypted bytes.
+    )",
+    .impl = prim_readAgeBase64,
+});
+
+static RegisterPrimOp primop_readAgeRange({
+    .name = "readAgeRange",
+    .args = {"attrs"},
+    .doc = R"(
+      Decrypt the bytes `offset` to `offset + length` of an age-encrypted
+      file and return them as a string. Only the 64 KiB chunks overlapping
+      the range are read and decrypted, so a small slice of a large file is
+      cheap.
+
+      *attrs* is an attribute set as accepted by `builtins.readAge`, with
+      two more attributes:
+
+      - `offset` (integer, required): Where the range starts in the
+        plaintext.
+      - `length` (integer, required): The number of bytes to read.
+
+      `hash` is the hash of the range, not of the whole plaintext. The
+      range is not added to the store, so decrypting it always needs an
+      identity. `compression` is not supported.
+    )",
+    .impl = prim_readAgeRange,
+});
+
+static RegisterPrimOp primop_readAgeJSON({
+    .name = "readAgeJSON",
+    .args = {"attrs"},
+    .doc = R"(
+      Decrypt an age-encrypted JSON file and return its contents as a Nix
+      value, like `builtins.fromJSON (builtins.readAge attrs)` but without
+      the intermediate string value.
+
+      *attrs* is an attribute set as accepted by `builtins.readAge`; `hash`
+      is the hash of the decrypted JSON text.
+    )",
+    .impl = prim_readAgeJSON,
+});
+
+static RegisterPrimOp primop_readAgeTOML({
+    .name = "readAgeTOML",
+    .args = {"attrs"},
+    .doc = R"(
+      Decrypt an age-encrypted TOML file and return its contents as a Nix
+      value, like `builtins.fromTOML (builtins.readAge attrs)`.
+
+      *attrs* is an attribute set as accepted by `builtins.readAge`; `hash`
+      is the hash of the decrypted TOML text.
+    )",
+    .impl = prim_readAgeTOML,
+});
+
+static RegisterPrimOp primop_readAgeCBOR({
+    .name = "readAgeCBOR",
+    .args = {"attrs"},
+    .doc = R"(
+      Decrypt an age-encrypted CBOR (RFC 8949) file and return its contents
+      as a Nix value. Maps, which must have text keys, become attribute
+      sets, arrays become lists, and byte and text strings become strings.
+      Tags are ignored.
+
+      *attrs* is an attribute set as accepted by `builtins.readAge`; `hash`
+      is the hash of the decrypted CBOR data.
+    )",
+    .impl = prim_readAgeCBOR,
+});
+
+static RegisterPrimOp primop_importAgeTree({
+    .name = "importAgeTree",
+    .args = {"attrs"},
+    .doc = R"(
+      Decrypt an age-encrypted directory tree and return its evaluated
+      `default.nix`, like `import` on a directory. The plaintext must be a
+      NAR, e.g. `nix-store --dump ./dir | age -r ... -o dir.nar.age`.
+
+      *attrs* is an attribute set with the following attributes:
+
+      - `file` (path, required): Path to the age-encrypted NAR.
+      - `hash` (string, optional): SRI hash (SHA-256 or BLAKE3) of the NAR,
+        as printed by `nix hash path ./dir`.
+      - `compression` (string, optional): `"zstd"` for a compressed NAR,
+        as for `builtins.readAge`.
+
+      The tree is decrypted once and added to the store as a single path,
+      so files in it can import each other by relative paths. When `hash`
+      is provided and that store path exists, no decryption or identity is
+      needed. Without `hash`, impure mode is required.
+    )",
+    .impl = prim_importAgeTree,
+});
+
+static RegisterPrimOp primop_readAgeTree({
+    .name = "readAgeTree",
+    .args = {"attrs"},
+    .doc = R"(
+      Decrypt an age-encrypted directory tree, add it to the store, and
+      return its store path as a string with context.
+
+      *attrs* is an attribute set as accepted by `builtins.importAgeTree`.
+    )",
+    .impl = prim_readAgeTree,
+});
+
+static RegisterPrimOp primop_ageLockedPath({
+    .name = "ageLockedPath",
+    .args = {"attrs"},
+    .doc = R"(
+      Return the store path that an age-encrypted file decrypts to, as a
+      string with context, without decrypting it or querying the store.
+
+      *attrs* is an attribute set as accepted by `builtins.readAge`; `hash`
+      is required, since the path is computed from it. This suits secrets
+      that are only referred to by path, such as
+      `environment.etc.<name>.source`: evaluating them costs no I/O at
+      all.
+
+      The path need not exist yet. Each secret is recorded, once, in
+      `$XDG_RUNTIME_DIR/mini-agenix/pending` (or `$MINI_AGENIX_PENDING`),
+      and `mini-agenix-realise`, run after evaluation and before building,
+      substitutes or decrypts all recorded secrets in parallel through
+      `builtins.prefetchAge`.
+
+      Until then, a derivation that refers to the path cannot be
+      instantiated: the store refuses to add a derivation whose inputs do
+      not exist, so `nix build`, `nix-instantiate` and evaluating `drvPath`
+      fail with an error that the path does not exist or is not valid.
+      Evaluate with `nix eval --read-only`, which computes derivations
+      without adding them to the store, run `mini-agenix-realise`, and only
+      then build.
+    )",
+    .impl = prim_ageLockedPath,
+});
+
+static RegisterPrimOp primop_importAgeBundle({
+    .name = "importAgeBundle",
+    .args = {"attrs"},
+    .doc = R"(
+      Open an age-encrypted bundle of secrets, as written by
+      `mini-agenix-bundle`, and return an attribute set with one string
+      attribute per entry.
+
+      *attrs* is an attribute set with the following attributes:
+
+      - `file` (path, required): Path to the age-encrypted bundle.
+      - `hash` (string, optional): SRI hash (SHA-256 or BLAKE3) of the bundle's
+        index, as printed by `mini-agenix-bundle`. The index holds the hash
+        of every entry, so this pins all of them.
+
+      The file key is unwrapped once, when the bundle is opened. Entries
+      are decrypted when their attribute is forced, and only the chunks of
+      the bundle that hold the entry are decrypted, so unused entries cost
+      nothing. Entries are not added to the store; an identity is needed
+      whenever the bundle is opened. Without `hash`, impure mode is
+      required.
+    )",
+    .impl = prim_importAgeBundle,
+});
+
+static RegisterPrimOp primop_prefetchAge({
+    .name = "prefetchAge",
+    .args = {"list"},
+    .doc = R"(
+      Decrypt a list of age-encrypted files ahead of use and return `null`.
+
+      Each element of *list* is an attribute set as accepted by
+      `builtins.readAge`. Secrets whose hash-locked store path already exists
+      are skipped. The other files are read together, with up to
+      `MINI_AGENIX_IO_DEPTH` (default: 128) reads in flight through io_uring,
+      or in a pool of threads where io_uring is unavailable. File keys held
+      by age plugins (`AGE-PLUGIN-*` identities) are unwrapped in one plugin
+      session per plugin for the whole list, rather than one session per
+      file. The remaining secrets are decrypted in parallel, at most
+      `MINI_AGENIX_JOBS` (default: the number of CPUs) at a time; duplicates
+      in the list are decrypted once. Errors are reported for the first
+      failing element of the list, as if its elements had been read one
+      after another.
+
+      With `MINI_AGENIX_AUTO_PREFETCH=1`, no list is needed for the common
+      case: the first time a file calls one of the age primops, calls in that
+      file like `builtins.readAge { file = ./x.age; hash = "sha256-..."; }`,
+      with a literal path and hash, are found in its syntax tree and
+      prefetched in the background. Secrets that need an age plugin or the
+      age binary are left to evaluation, which may prompt for them, and so
+      are those that another evaluation is decrypting or that would have to
+      be substituted. Prefetches still running when evaluation ends are
+      abandoned.
+
+      With `MINI_AGENIX_MANIFEST` set to a file, every secret with a `hash`
+      that an evaluation resolves is recorded in that file, and the next
+      evaluation prefetches the recorded secrets whose files are unchanged
+      in the same way, the slowest first, starting at its first call to an
+      age primop.
+    )",
+    .impl = prim_prefetchAge,
+});
@@ -1,5 +1,65 @@
 { pkgs, mini-agenix }:
 
+let
+  # Fake age plugin whose "fake" stanzas carry the file key in the clear.
+  # Every invocation is logged so that tests can count plugin sessions.
+  fakePlugin = pkgs.writeScriptBin "age-plugin-fake" ''
+    #!${pkgs.python3.interpreter}
+    import base64, os, sys
+
+    with open(os.environ.get("FAKE_PLUGIN_LOG", "/tmp/test/plugin-sessions.log"), "a") as log:
+        log.write(sys.argv[1] + "\n")
+
+    def read_stanza():
+        args = sys.stdin.readline().rstrip("\n").split(" ")[1:]
+        body = ""
+        while True:
+            line = sys.stdin.readline().rstrip("\n")
+            body += line
+            if len(line) < 64:
+                break
+        return args, base64.b64decode(body + "=" * (-len(body) % 4))
+
+    def write_stanza(args, body=b""):
+        enc = base64.b64encode(body).decode().rstrip("=")
+        lines = [enc[i:i + 64] for i in range(0, len(enc), 64)]
+        if not lines or len(lines[-1]) == 64:
+            lines.append("")
+        sys.stdout.write("-> " + " ".join(args) + "\n" + "\n".join(lines) + "\n")
+        sys.stdout.flush()
+
+    phase1 = []
+    while True:
+        args, body = read_stanza()
+        if args[0] == "done":
+            break
+        phase1.append((args, body))
+
+    if sys.argv[1] == "--age-plugin=recipient-v1":
+        keys = [body for args, body in phase1 if args[0] == "wrap-file-key"]
+        for i, key in enumerate(keys):
+            write_stanza(["recipient-stanza", str(i), "fake"], key)
+            read_stanza()
+    else:
+        write_stanza(["msg"], b"fake plugin unwrapping")
+        read_stanza()
+        # Like a PIN-protected hardware key, with FAKE_PLUGIN_PIN set.
+        pin = os.environ.get("FAKE_PLUGIN_PIN")
+        if pin is not None:
+            write_stanza(["request-secret"], b"Enter the PIN:")
+            args, body = read_stanza()
+            if args[0] != "ok" or body != pin.encode():
+                write_stanza(["error", "internal"], b"no PIN")
+                read_stanza()
+                write_stanza(["done"])
+                sys.exit(0)
+        for args, body in phase1:
+            if args[0] == "recipient-stanza" and args[2] == "fake":
+                write_stanza(["file-key", args[1]], body)
+                read_stanza()
+    write_stanza(["done"])
+  '';
+in
 pkgs.testers.runNixOSTest {
   name = "mini-agenix-plugin";
 
@@ -10,6 +70,10 @@ pkgs.testers.runNixOSTest {
       environment.systemPackages = [
         pkgs.age
         pkgs.nix
+        pkgs.openssh
+        pkgs.zstd
+        fakePlugin
+        mini-agenix
       ];
       nix.settings.experimental-features = [ "nix-command" ];
     };
@@ -29,7 +93,7 @@ pkgs.testers.runNixOSTest {
       KEY = f"{DIR}/key.txt"
       NIX = "${nix}"
 
-      def nix_eval(expr, *, impure=False, pure=False, raw=False, env="", expect_fail=False):
+      def nix_eval(expr, *, impure=False, pure=False, raw=False, read_only=False, env="", expect_fail=False):
           """Write a Nix expression to a file and evaluate it."""
           machine.succeed(f"cat > {DIR}/eval.nix <<'NIXEOF'\n{expr}\nNIXEOF")
           flags = ""
@@ -39,6 +103,8 @@ pkgs.testers.runNixOSTest {
               flags += " --option pure-eval true"
           if raw:
               flags += " --raw"
+          if read_only:
+              flags += " --read-only"
           prefix = f"{env} " if env else ""
           cmd = f"cd {DIR} && {prefix}{NIX}{flags} --file {DIR}/eval.nix"
           if expect_fail:
@@ -101,6 +167,22 @@ pkgs.testers.runNixOSTest {
       )
       assert result == "hello from age", f"readAge locked: {result!r}"
 
+      # ── readAge locked with a BLAKE3 hash (needs the blake3-hashes feature) ──
+
+      blake3_env = f"NIX_CONFIG='extra-experimental-features = blake3-hashes' {env}"
+      status, blake3_hash = machine.execute(
+          f"printf 'hello from age' | {blake3_env} nix --extra-experimental-features nix-command "
+          "hash file --algo blake3 /dev/stdin"
+      )
+      if status == 0:
+          result = nix_eval(
+              f'builtins.readAge {{ file = {DIR}/plain.txt.age; hash = "{blake3_hash.strip()}"; }}',
+              raw=True, env=blake3_env,
+          )
+          assert result == "hello from age", f"readAge blake3: {result!r}"
+      else:
+          machine.log("nix has no BLAKE3 hashes, skipping BLAKE3 test")
+
       # ── readAge wrong hash → error ──
 
       nix_eval(
@@ -115,6 +197,62 @@ pkgs.testers.runNixOSTest {
           impure=True, raw=True, env=env, expect_fail=True,
       )
 
+      # ── armored input (age --armor) ──
+
+      machine.succeed(
+          f"head -c 150000 /dev/urandom | base64 -w0 > {DIR}/armored.txt && "
+          f"age --armor -r $(age-keygen -y {KEY}) -o {DIR}/armored.txt.age {DIR}/armored.txt"
+      )
+      result = nix_eval(
+          f"builtins.readAge {{ file = {DIR}/armored.txt.age; }} == builtins.readFile {DIR}/armored.txt",
+          impure=True, env=env,
+      ).strip()
+      assert result == "true", f"readAge armored: {result!r}"
+
+      # ── zstd-compressed plaintext (hash of the decompressed contents) ──
+
+      machine.succeed(
+          f"seq 1 50000 > {DIR}/compressed.txt && "
+          f"zstd -q -c {DIR}/compressed.txt | age -r $(age-keygen -y {KEY}) -o {DIR}/compressed.txt.age"
+      )
+      compressed_hash = machine.succeed(
+          f"nix --extra-experimental-features nix-command hash file {DIR}/compressed.txt"
+      ).strip()
+      result = nix_eval(
+          f'builtins.readAge {{ file = {DIR}/compressed.txt.age; hash = "{compressed_hash}"; compression = "zstd"; }} '
+          f"== builtins.readFile {DIR}/compressed.txt",
+          impure=True, env=env,
+      ).strip()
+      assert result == "true", f"readAge zstd: {result!r}"
+
+      # ── readAgeRange (binary and armored) ──
+
+      machine.succeed(
+          f"head -c 300000 /dev/urandom | base64 -w0 > {DIR}/ranged.txt && "
+          f"age -r $(age-keygen -y {KEY}) -o {DIR}/ranged.txt.age {DIR}/ranged.txt"
+      )
+      for f in ["ranged.txt.age", "armored.txt.age"]:
+          plain = f.removesuffix(".age")
+          result = nix_eval(
+              f"builtins.readAgeRange {{ file = {DIR}/{f}; offset = 65530; length = 70000; }} "
+              f"== builtins.substring 65530 70000 (builtins.readFile {DIR}/{plain})",
+              impure=True, env=env,
+          ).strip()
+          assert result == "true", f"readAgeRange {f}: {result!r}"
+      nix_eval(
+          f"builtins.readAgeRange {{ file = {DIR}/ranged.txt.age; offset = 400000; length = 1; }}",
+          impure=True, env=env, expect_fail=True,
+      )
+
+      # ── readAgeBase64 (binary-safe) ──
+
+      result = nix_eval(
+          f"builtins.readAgeBase64 {{ file = {DIR}/null.bin.age; }}",
+          impure=True, raw=True, env=env,
+      )
+      expected = machine.succeed("printf 'has\\x00null' | base64 -w0").strip()
+      assert result == expected, f"readAgeBase64: {result!r} != {expected!r}"
+
       # ── importAge impure ──
 
       result = nix_eval(
@@ -135,6 +273,75 @@ pkgs.testers.runNixOSTest {
       ).strip()
       assert result == "42", f"importAge locked: {result!r}"
 
+      # ── importAge from memory (store = false) ──
+
+      machine.succeed(f"echo '{{ y = 7; }}' | age -r $(age-keygen -y {KEY}) -o {DIR}/mem.nix.age")
+      result = nix_eval(
+          f"(builtins.importAge {{ file = {DIR}/mem.nix.age; store = false; }}).y",
+          impure=True, env=env,
+      ).strip()
+      assert result == "7", f"importAge in memory: {result!r}"
+      machine.fail("ls /nix/store | grep -- '-mem.nix$'")
+
+      # ── structured secrets (JSON, TOML, CBOR) ──
+
+      machine.succeed(
+          f"echo '{{\"a\": 1, \"b\": [2, 3]}}' | age -r $(age-keygen -y {KEY}) -o {DIR}/data.json.age && "
+          f"printf 'a = 1\\nb = [2, 3]\\n' | age -r $(age-keygen -y {KEY}) -o {DIR}/data.toml.age && "
+          f"printf '\\xa2\\x61\\x61\\x01\\x61\\x62\\x82\\x02\\x03' | age -r $(age-keygen -y {KEY}) -o {DIR}/data.cbor.age"
+      )
+      for fmt in ["JSON", "TOML", "CBOR"]:
+          result = nix_eval(
+              f"with builtins.readAge{fmt} {{ file = {DIR}/data.{fmt.lower()}.age; }}; a + builtins.elemAt b 1",
+              impure=True, env=env,
+          ).strip()
+          assert result == "4", f"readAge{fmt}: {result!r}"
+
+      # ── directory trees (importAgeTree, readAgeTree) ──
+
+      machine.succeed(
+          f"mkdir -p {DIR}/tree/sub && "
+          f"echo '{{ z = import ./sub/z.nix; }}' > {DIR}/tree/default.nix && "
+          f"echo '5' > {DIR}/tree/sub/z.nix && "
+          f"nix-store --dump {DIR}/tree | age -r $(age-keygen -y {KEY}) -o {DIR}/tree.nar.age"
+      )
+      tree_hash = machine.succeed(
+          f"nix --extra-experimental-features nix-command hash path {DIR}/tree"
+      ).strip()
+      result = nix_eval(
+          f'(builtins.importAgeTree {{ file = {DIR}/tree.nar.age; hash = "{tree_hash}"; }}).z',
+          env=env,
+      ).strip()
+      assert result == "5", f"importAgeTree: {result!r}"
+      result = nix_eval(
+          f'builtins.readFile (builtins.readAgeTree {{ file = {DIR}/tree.nar.age; hash = "{tree_hash}"; }} + "/sub/z.nix")',
+          raw=True, env=env,
+      ).strip()
+      assert result == "5", f"readAgeTree: {result!r}"
+
+      # ── bundles (importAgeBundle) ──
+
+      machine.succeed(
+          f"echo -n 'bundled password' > {DIR}/password && "
+          f"head -c 200000 /dev/urandom | base64 -w0 > {DIR}/large && "
+          f"cd {DIR} && mini-agenix-bundle password token={DIR}/large 2>{DIR}/bundle-hash.txt "
+          f"| age -r $(age-keygen -y {KEY}) -o {DIR}/secrets.bundle.age"
+      )
+      bundle_hash = machine.succeed(
+          f"grep -oP 'sha256-[A-Za-z0-9+/=]+' {DIR}/bundle-hash.txt"
+      ).strip()
+      result = nix_eval(
+          f'(builtins.importAgeBundle {{ file = {DIR}/secrets.bundle.age; hash = "{bundle_hash}"; }}).password',
+          raw=True, env=env,
+      )
+      assert result == "bundled password", f"importAgeBundle: {result!r}"
+      result = nix_eval(
+          f"let b = builtins.importAgeBundle {{ file = {DIR}/secrets.bundle.age; }}; "
+          f"in builtins.attrNames b ++ [ (b.token == builtins.readFile {DIR}/large) ]",
+          impure=True, env=env,
+      ).strip()
+      assert result == '[ "password" "token" true ]', f"importAgeBundle entries: {result!r}"
+
       # ── pure eval without hash → error ──
 
       nix_eval(
@@ -165,6 +372,420 @@ pkgs.testers.runNixOSTest {
       assert result == "hello from age", f"SSH discovery: {result!r}"
       machine.succeed("rm /root/.ssh/id_ed25519")
 
+      # ── ssh-rsa identity (unwrapped in-process) ──
+
+      machine.succeed(f'ssh-keygen -q -t rsa -b 3072 -N "" -f {DIR}/id_rsa')
+      machine.succeed(
+          f"echo -n 'hello from rsa' | age -R {DIR}/id_rsa.pub -o {DIR}/rsa.txt.age"
+      )
+      result = nix_eval(
+          f"builtins.readAge {{ file = {DIR}/rsa.txt.age; }}",
+          impure=True, raw=True, env=f"AGE_IDENTITY_FILE={DIR}/id_rsa",
+      )
+      assert result == "hello from rsa", f"ssh-rsa: {result!r}"
+
+      # ── ML-KEM-768 + X25519 identity (needs age >= 1.3) ──
+
+      status, _ = machine.execute(f"age-keygen -pq -o {DIR}/pq.txt")
+      if status == 0:
+          machine.succeed(
+              f"echo -n 'hello from pq' | age -r $(age-keygen -y {DIR}/pq.txt) -o {DIR}/pq.txt.age"
+          )
+          result = nix_eval(
+              f"builtins.readAge {{ file = {DIR}/pq.txt.age; }}",
+              impure=True, raw=True, env=f"AGE_IDENTITY_FILE={DIR}/pq.txt",
+          )
+          assert result == "hello from pq", f"mlkem768x25519: {result!r}"
+      else:
+          machine.log("age-keygen has no -pq, skipping mlkem768x25519 test")
+
+      # ── age plugin identities (one session per batch) ──
+
+      FAKE_RECIPIENT = "age1fake1veskkeg0grne9"
+      machine.succeed(f"echo AGE-PLUGIN-FAKE-1VESKKEGTE2VN9 > {DIR}/fake-identity.txt")
+      for i in range(3):
+          machine.succeed(
+              f"echo -n 'plugin secret {i}' | age -r {FAKE_RECIPIENT} -o {DIR}/plugin{i}.txt.age"
+          )
+      machine.succeed(f"rm -f {DIR}/plugin-sessions.log")
+      secrets = " ".join(f"{{ file = {DIR}/plugin{i}.txt.age; }}" for i in range(3))
+      result = nix_eval(
+          f"builtins.seq (builtins.prefetchAge [ {secrets} ]) "
+          f'(builtins.concatStringsSep "," (map builtins.readAge [ {secrets} ]))',
+          impure=True, raw=True, env=f"AGE_IDENTITY_FILE={DIR}/fake-identity.txt",
+      )
+      assert result == "plugin secret 0,plugin secret 1,plugin secret 2", f"plugin: {result!r}"
+      sessions = machine.succeed(f"grep -c identity-v1 {DIR}/plugin-sessions.log").strip()
+      assert sessions == "1", f"plugin sessions: {sessions}"
+      # Decrypted by the evaluation before, so neither the batch nor the
+      # decryptions under the lock start a session.
+      machine.succeed(f"rm -f {DIR}/plugin-sessions.log")
+      result = nix_eval(
+          f"builtins.seq (builtins.prefetchAge [ {secrets} ]) "
+          f'(builtins.concatStringsSep "," (map builtins.readAge [ {secrets} ]))',
+          impure=True, raw=True, env=f"AGE_IDENTITY_FILE={DIR}/fake-identity.txt",
+      )
+      assert result == "plugin secret 0,plugin secret 1,plugin secret 2", f"plugin again: {result!r}"
+      sessions = machine.succeed(f"cat {DIR}/plugin-sessions.log 2>/dev/null | grep -c identity-v1 || true").strip()
+      assert sessions == "0", f"plugin sessions after decryption: {sessions}"
+
+      # A plugin that asks for a PIN is left to the age binary, which asks
+      # on the terminal.
+      machine.succeed(f"echo -n 'pin secret' | age -r {FAKE_RECIPIENT} -o {DIR}/pin.txt.age")
+      machine.succeed(f"echo 'builtins.readAge {{ file = {DIR}/pin.txt.age; }}' > {DIR}/pin.nix")
+      result = machine.succeed(
+          f"echo 1234 | FAKE_PLUGIN_PIN=1234 AGE_IDENTITY_FILE={DIR}/fake-identity.txt "
+          f"script -qec '{NIX} --impure --raw --file {DIR}/pin.nix' /dev/null"
+      )
+      assert "pin secret" in result, f"plugin with a PIN: {result!r}"
+
+      # ── concurrent evaluations decrypt a secret only once ──
+
+      machine.succeed(
+          f"echo -n 'shared secret' | age -r {FAKE_RECIPIENT} -o {DIR}/shared.txt.age"
+      )
+      machine.succeed(f"rm -f {DIR}/plugin-sessions.log")
+      machine.succeed(f"echo 'builtins.readAge {{ file = {DIR}/shared.txt.age; }}' > {DIR}/shared.nix")
+      machine.succeed(
+          "for i in 1 2 3 4; do "
+          f"AGE_IDENTITY_FILE={DIR}/fake-identity.txt {NIX} --impure --raw --file {DIR}/shared.nix "
+          f">{DIR}/shared-$i.out & "
+          "done; wait"
+      )
+      for i in range(1, 5):
+          result = machine.succeed(f"cat {DIR}/shared-{i}.out")
+          assert result == "shared secret", f"concurrent {i}: {result!r}"
+      sessions = machine.succeed(f"grep -c identity-v1 {DIR}/plugin-sessions.log").strip()
+      assert sessions == "1", f"concurrent plugin sessions: {sessions}"
+
+      # ── prefetchAge from many threads, with duplicates ──
+
+      for i in range(8):
+          machine.succeed(
+              f"echo -n 'parallel secret {i}' | age -r $(age-keygen -y {KEY}) -o {DIR}/parallel{i}.txt.age"
+          )
+      parallel = " ".join(f"{{ file = {DIR}/parallel{i % 8}.txt.age; }}" for i in range(64))
+      result = nix_eval(
+          f"builtins.seq (builtins.prefetchAge [ {parallel} ]) "
+          f'(builtins.concatStringsSep "," (map builtins.readAge [ {parallel} ]))',
+          impure=True, raw=True, env=f"AGE_IDENTITY_FILE={KEY} MINI_AGENIX_JOBS=16",
+      )
+      assert result == ",".join(f"parallel secret {i % 8}" for i in range(64)), f"parallel: {result!r}"
+      wrong_hash = machine.succeed(
+          f"echo -n 'parallel secret 1' > {DIR}/parallel.txt && "
+          f"nix --extra-experimental-features nix-command hash file {DIR}/parallel.txt"
+      ).strip()
+      wrong = " ".join(
+          f'{{ file = {DIR}/parallel5.txt.age; hash = "{wrong_hash}"; }}' if i == 37
+          else f"{{ file = {DIR}/parallel{i % 8}.txt.age; }}"
+          for i in range(64)
+      )
+      error = nix_eval(
+          f"builtins.prefetchAge [ {wrong} ]",
+          impure=True, env=f"AGE_IDENTITY_FILE={KEY} MINI_AGENIX_JOBS=16", expect_fail=True,
+      )
+      assert "hash mismatch" in error and "parallel5.txt.age" in error, f"parallel mismatch: {error!r}"
+
+      # ── prefetchAge with a batch of pinned secrets ──
+
+      pinned_hashes = []
+      for i in range(8):
+          machine.succeed(
+              f"echo -n 'pinned secret {i}' > {DIR}/pinned.txt && "
+              f"age -r $(age-keygen -y {KEY}) -o {DIR}/pinned{i}.txt.age {DIR}/pinned.txt"
+          )
+          pinned_hashes.append(
+              machine.succeed(
+                  f"nix --extra-experimental-features nix-command hash file {DIR}/pinned.txt"
+              ).strip()
+          )
+      pinned = " ".join(
+          f'{{ file = {DIR}/pinned{i}.txt.age; hash = "{pinned_hashes[i]}"; }}' for i in range(8)
+      )
+      result = nix_eval(
+          f"builtins.seq (builtins.prefetchAge [ {pinned} ]) "
+          f'(builtins.concatStringsSep "," (map builtins.readAge [ {pinned} ]))',
+          raw=True, env=env,
+      )
+      assert result == ",".join(f"pinned secret {i}" for i in range(8)), f"pinned batch: {result!r}"
+      error = nix_eval(
+          f'builtins.prefetchAge [ {{ file = {DIR}/pinned0.txt.age; hash = "{pinned_hashes[1]}"; }} ]',
+          env=env, expect_fail=True,
+      )
+      assert "hash mismatch" in error, f"pinned batch mismatch: {error!r}"
+
+      # ── prefetchAge reads more files than fit in flight ──
+
+      machine.succeed(
+          f"head -c 300000 /dev/urandom | base64 -w0 > {DIR}/large.txt && "
+          f"age -r $(age-keygen -y {KEY}) -o {DIR}/large.txt.age {DIR}/large.txt"
+      )
+      queued = " ".join(
+          [f"{{ file = {DIR}/parallel{i}.txt.age; }}" for i in range(8)] + [f"{{ file = {DIR}/large.txt.age; }}"]
+      )
+      result = nix_eval(
+          f"builtins.seq (builtins.prefetchAge [ {queued} ]) "
+          f'(builtins.hashString "sha256" (builtins.concatStringsSep "," (map builtins.readAge [ {queued} ])))',
+          impure=True, raw=True, env=f"{env} MINI_AGENIX_IO_DEPTH=3",
+      )
+      expected = machine.succeed(
+          f"{{ printf 'parallel secret %s,' 0 1 2 3 4 5 6 7; cat {DIR}/large.txt; }} | sha256sum | cut -d' ' -f1"
+      ).strip()
+      assert result == expected, f"queued reads: {result!r}"
+      error = nix_eval(
+          f"builtins.prefetchAge [ {{ file = {DIR}/parallel0.txt.age; }} {{ file = {DIR}/missing.txt.age; }} ]",
+          impure=True, env=f"{env} MINI_AGENIX_IO_DEPTH=1", expect_fail=True,
+      )
+      assert "does not exist" in error, f"queued reads, missing file: {error!r}"
+
+      # ── automatic prefetching changes nothing but timing ──
+
+      auto_hashes = []
+      for i in range(4):
+          machine.succeed(
+              f"echo -n 'auto secret {i}' > {DIR}/auto.txt && "
+              f"age -r $(age-keygen -y {KEY}) -o {DIR}/auto{i}.txt.age {DIR}/auto.txt"
+          )
+          auto_hashes.append(
+              machine.succeed(
+                  f"nix --extra-experimental-features nix-command hash file {DIR}/auto.txt"
+              ).strip()
+          )
+      calls = "\n".join(
+          f'  (builtins.readAge {{ file = ./auto{i}.txt.age; hash = "{auto_hashes[i]}"; }})' for i in range(4)
+      )
+      machine.succeed(f"cat > {DIR}/auto.nix <<'NIXEOF'\n[\n{calls}\n]\nNIXEOF")
+      result = nix_eval(
+          'builtins.concatStringsSep "," (import ./auto.nix)',
+          raw=True, env=f"{env} MINI_AGENIX_AUTO_PREFETCH=1",
+      )
+      assert result == ",".join(f"auto secret {i}" for i in range(4)), f"auto prefetch: {result!r}"
+      machine.succeed(
+          f"cat > {DIR}/auto-wrong.nix <<'NIXEOF'\n"
+          f'[ (builtins.readAge {{ file = ./pinned2.txt.age; hash = "{pinned_hashes[2]}"; }})\n'
+          f'  (builtins.readAge {{ file = ./auto0.txt.age; hash = "{auto_hashes[1]}"; }}) ]\n'
+          "NIXEOF"
+      )
+      for prefetch in ["0", "1"]:
+          error = nix_eval(
+              "builtins.deepSeq (import ./auto-wrong.nix) null",
+              env=f"{env} MINI_AGENIX_AUTO_PREFETCH={prefetch}", expect_fail=True,
+          )
+          assert "hash mismatch" in error, f"auto prefetch {prefetch}, wrong hash: {error!r}"
+
+      # A prefetch does not wait for another evaluation's lock, so the
+      # evaluation that started it exits without waiting for it either.
+      held_hashes = []
+      for i in range(2):
+          machine.succeed(
+              f"echo -n 'held secret {i}' > {DIR}/held.txt && "
+              f"age -r $(age-keygen -y {KEY}) -o {DIR}/held{i}.txt.age {DIR}/held.txt"
+          )
+          held_hashes.append(
+              machine.succeed(f"nix --extra-experimental-features nix-command hash file {DIR}/held.txt").strip()
+          )
+      machine.succeed(
+          f"cat > {DIR}/held.nix <<'NIXEOF'\n"
+          f'{{ a = builtins.readAge {{ file = ./held0.txt.age; hash = "{held_hashes[0]}"; }};\n'
+          f'  b = builtins.readAge {{ file = ./held1.txt.age; hash = "{held_hashes[1]}"; }}; }}\n'
+          "NIXEOF\n"
+          f"echo '(import ./held.nix).a' > {DIR}/held-eval.nix"
+      )
+      holder = machine.succeed(
+          "dir=''${XDG_RUNTIME_DIR:+$XDG_RUNTIME_DIR/mini-agenix}; dir=''${dir:-/tmp/mini-agenix-$(id -u)}; "
+          f"flock $dir/decrypted/$(sha256sum {DIR}/held1.txt.age | cut -d' ' -f1).lock sleep 600 "
+          ">/dev/null 2>&1 & echo $!"
+      ).strip()
+      result = machine.succeed(
+          f"cd {DIR} && {env} MINI_AGENIX_AUTO_PREFETCH=1 timeout 60 {NIX} --raw --file {DIR}/held-eval.nix"
+      )
+      assert result == "held secret 0", f"prefetch behind a held lock: {result!r}"
+      machine.succeed(f"kill {holder}")
+
+      # ── the manifest of resolved secrets is replayed and kept compact ──
+
+      manifest_env = f"{env} MINI_AGENIX_MANIFEST={DIR}/resolved"
+      for run in range(3):
+          result = nix_eval(
+              'builtins.concatStringsSep "," (import ./auto.nix)', raw=True, env=manifest_env,
+          )
+          assert result == ",".join(f"auto secret {i}" for i in range(4)), f"manifest run {run}: {result!r}"
+          lines = machine.succeed(f"wc -l < {DIR}/resolved").strip()
+          # Each run appends the 4 secrets; the writer compacts the file
+          # back to them once it has doubled.
+          assert 4 <= int(lines) <= 8, f"manifest run {run}: {lines} lines"
+      machine.succeed(f"grep -q '\t{DIR}/auto0.txt.age$' {DIR}/resolved")
+
+      # ── ageLockedPath defers decryption to mini-agenix-realise ──
+
+      machine.succeed(
+          f"echo -n 'deferred secret' > {DIR}/deferred.txt && "
+          f"age -r $(age-keygen -y {KEY}) -o {DIR}/deferred.txt.age {DIR}/deferred.txt"
+      )
+      deferred_hash = machine.succeed(
+          f"nix --extra-experimental-features nix-command hash file {DIR}/deferred.txt"
+      ).strip()
+      deferred_path = nix_eval(
+          f'builtins.ageLockedPath {{ file = {DIR}/deferred.txt.age; hash = "{deferred_hash}"; }}',
+          raw=True,
+      ).strip()
+      assert deferred_path.endswith("-deferred.txt"), f"ageLockedPath: {deferred_path!r}"
+      # A hash that mini-agenix-realise could not check is never recorded.
+      deferred_sha512 = machine.succeed(
+          f"nix --extra-experimental-features nix-command hash file --type sha512 {DIR}/deferred.txt"
+      ).strip()
+      error = nix_eval(
+          f'builtins.ageLockedPath {{ file = {DIR}/deferred.txt.age; hash = "{deferred_sha512}"; }}',
+          raw=True, expect_fail=True,
+      )
+      assert "only supports SHA-256 and BLAKE3" in error, f"ageLockedPath with SHA-512: {error!r}"
+      machine.fail(f"test -e {deferred_path}")
+      machine.succeed(f"AGE_IDENTITY_FILE={KEY} mini-agenix-realise")
+      result = machine.succeed(f"cat {deferred_path}")
+      assert result == "deferred secret", f"realised: {result!r}"
+      # The manifest was emptied, so there is nothing left to do.
+      machine.succeed("mini-agenix-realise")
+
+      # A consumer cannot be instantiated before realise; evaluating it
+      # read-only records the secret, once however often it is evaluated.
+      machine.succeed(
+          f"echo -n 'consumed secret' > {DIR}/consumed.txt && "
+          f"age -r $(age-keygen -y {KEY}) -o {DIR}/consumed.txt.age {DIR}/consumed.txt"
+      )
+      consumed_hash = machine.succeed(
+          f"nix --extra-experimental-features nix-command hash file {DIR}/consumed.txt"
+      ).strip()
+      pending_env = f"MINI_AGENIX_PENDING={DIR}/pending"
+      consumed = f'builtins.ageLockedPath {{ file = {DIR}/consumed.txt.age; hash = "{consumed_hash}"; }}'
+      consumed_path = nix_eval(consumed, raw=True, env=pending_env).strip()
+      consumer = (
+          f"let secret = {consumed}; in "
+          '(derivation { name = "consumer"; system = builtins.currentSystem; builder = "/bin/sh"; '
+          'args = [ "-c" "cat ''${secret} > $out" ]; }).drvPath'
+      )
+      error = nix_eval(consumer, raw=True, env=pending_env, expect_fail=True)
+      assert consumed_path.removeprefix("/nix/store/") in error, f"consumer before realise: {error!r}"
+      for _ in range(3):
+          nix_eval(consumer, raw=True, read_only=True, env=pending_env)
+      pending = machine.succeed(f"grep -c consumed.txt.age {DIR}/pending").strip()
+      assert pending == "1", f"pending entries: {pending}"
+      machine.succeed(f"{pending_env} AGE_IDENTITY_FILE={KEY} mini-agenix-realise")
+      nix_eval(consumer, raw=True, env=pending_env)
+
+      # ── age+file flake inputs ──
+
+      machine.succeed(
+          f"mkdir -p {DIR}/flake && "
+          f"echo -n 'flake input secret' | age -r $(age-keygen -y {KEY}) -o {DIR}/flake-input.txt.age"
+      )
+      machine.succeed(
+          f"cat > {DIR}/flake/flake.nix <<'EOF'\n"
+          "{\n"
+          f'  inputs.secret = {{ url = "age+file://{DIR}/flake-input.txt.age"; flake = false; }};\n'
+          "  outputs = { self, secret }: { value = builtins.readFile secret; };\n"
+          "}\n"
+          "EOF"
+      )
+      flake_eval = f"cd {DIR}/flake && {NIX} --extra-experimental-features flakes --raw path:{DIR}/flake#value"
+      result = machine.succeed(f"AGE_IDENTITY_FILE={KEY} {flake_eval}")
+      assert result == "flake input secret", f"age+file input: {result!r}"
+      lock = machine.succeed(f"cat {DIR}/flake/flake.lock")
+      assert '"type": "age"' in lock and '"narHash"' in lock, f"flake.lock: {lock}"
+      # Locked and in the store: no identity needed any more.
+      result = machine.succeed(f"AGE_IDENTITY_FILE=/nonexistent {flake_eval}")
+      assert result == "flake input secret", f"locked age+file input: {result!r}"
+
+      # Unlocked inputs go through the fetcher cache: an unchanged file is
+      # not decrypted again.
+      fetch_input = lambda url: (
+          f"{NIX} --extra-experimental-features flakes --impure --raw "
+          f"--expr 'builtins.readFile (builtins.fetchTree \"{url}\")'"
+      )
+      input_url = f"age+file://{DIR}/flake-input.txt.age?compression=none"
+      machine.succeed(f"AGE_IDENTITY_FILE={KEY} {fetch_input(input_url)}")
+      result = machine.succeed(f"AGE_IDENTITY_FILE=/nonexistent {fetch_input(input_url)}")
+      assert result == "flake input secret", f"cached age+file input: {result!r}"
+      error = machine.fail(f"AGE_IDENTITY_FILE={KEY} {fetch_input(f'age+file://{DIR}/missing.txt.age')} 2>&1")
+      assert f"age input 'age+file://{DIR}/missing.txt.age'" in error, f"missing age+file input: {error!r}"
+      # A tree input is checked to be a canonical NAR, like importAgeTree.
+      machine.succeed(
+          f"{{ nix-store --dump {DIR}/tree; echo trailing; }} | age -r $(age-keygen -y {KEY}) -o {DIR}/trailing.nar.age"
+      )
+      error = machine.fail(f"AGE_IDENTITY_FILE={KEY} {fetch_input(f'age+file://{DIR}/trailing.nar.age?tree=1')} 2>&1")
+      assert "not a canonical NAR" in error, f"trailing age+file tree: {error!r}"
+
+      # ── mini-agenix-agent (identities held by a daemon) ──
+
+      agent_pid = machine.succeed(
+          f"mini-agenix-agent --socket {DIR}/agent/agent.sock -i {KEY} >{DIR}/agent.log 2>&1 & echo $!"
+      ).strip()
+      machine.wait_for_file(f"{DIR}/agent/agent.sock")
+      result = nix_eval(
+          f"builtins.readAge {{ file = {DIR}/plain.txt.age; }}",
+          impure=True, raw=True,
+          env=f"AGE_IDENTITY_FILE=/nonexistent/key MINI_AGENIX_AGENT_SOCKET={DIR}/agent/agent.sock",
+      )
+      assert result == "hello from age", f"agent: {result!r}"
+      error = machine.fail(f"mini-agenix-agent --socket {DIR}/agent/agent.sock -i {KEY} 2>&1")
+      assert "already listening" in error, f"second agent: {error!r}"
+      machine.succeed(f"kill {agent_pid} && while kill -0 {agent_pid} 2>/dev/null; do sleep 0.1; done")
+
+      # A socket left behind by an agent that is gone is taken over.
+      machine.succeed(f"test -S {DIR}/agent/agent.sock")
+      agent_pid = machine.succeed(
+          f"mini-agenix-agent --socket {DIR}/agent/agent.sock -i {KEY} >{DIR}/agent.log 2>&1 & echo $!"
+      ).strip()
+      machine.wait_until_succeeds(f"grep -q listening {DIR}/agent.log")
+      result = nix_eval(
+          f"builtins.readAge {{ file = {DIR}/plain.txt.age; }}",
+          impure=True, raw=True,
+          env=f"AGE_IDENTITY_FILE=/nonexistent/key MINI_AGENIX_AGENT_SOCKET={DIR}/agent/agent.sock",
+      )
+      assert result == "hello from age", f"agent on a stale socket: {result!r}"
+      machine.succeed(f"kill {agent_pid}")
+
+      # An agent run by another user is not asked, even if its socket is
+      # open to everyone.
+      machine.succeed(
+          f"install -d -o nobody -m 700 {DIR}/foreign && install -o nobody -m 400 {KEY} {DIR}/foreign/key.txt && "
+          f"echo -n 'foreign secret' | age -r $(age-keygen -y {KEY}) -o {DIR}/foreign.txt.age"
+      )
+      agent_pid = machine.succeed(
+          f"setpriv --reuid=nobody --regid=nogroup --clear-groups "
+          f"mini-agenix-agent --socket {DIR}/foreign/agent.sock -i {DIR}/foreign/key.txt "
+          f">{DIR}/foreign.log 2>&1 & echo $!"
+      ).strip()
+      machine.wait_until_succeeds(f"grep -q listening {DIR}/foreign.log")
+      machine.succeed(f"chmod 711 {DIR}/foreign && chmod 666 {DIR}/foreign/agent.sock")
+      nix_eval(
+          f"builtins.readAge {{ file = {DIR}/foreign.txt.age; }}",
+          impure=True, raw=True, expect_fail=True,
+          env=f"AGE_IDENTITY_FILE=/nonexistent/key MINI_AGENIX_AGENT_SOCKET={DIR}/foreign/agent.sock",
+      )
+      result = nix_eval(
+          f"builtins.readAge {{ file = {DIR}/foreign.txt.age; }}",
+          impure=True, raw=True,
+          env=f"AGE_IDENTITY_FILE={KEY} MINI_AGENIX_AGENT_SOCKET={DIR}/foreign/agent.sock",
+      )
+      assert result == "foreign secret", f"foreign agent: {result!r}"
+      machine.succeed(f"kill {agent_pid}")
+
+      # ── file keys cached in the kernel keyring ──
+
+      keyring_env = "MINI_AGENIX_KEYRING=user MINI_AGENIX_KEYRING_TIMEOUT=60"
+      machine.succeed(f"echo -n 'hello from keyring' | age -r $(age-keygen -y {KEY}) -o {DIR}/keyring.txt.age")
+      nix_eval(
+          f"builtins.readAge {{ file = {DIR}/keyring.txt.age; }}",
+          impure=True, raw=True, env=f"{keyring_env} AGE_IDENTITY_FILE={KEY}",
+      )
+      # An identity file without any keys: only the keyring can help.
+      machine.succeed(f"touch {DIR}/empty-identity.txt")
+      result = nix_eval(
+          f"builtins.readAge {{ file = {DIR}/keyring.txt.age; }}",
+          impure=True, raw=True, env=f"{keyring_env} AGE_IDENTITY_FILE={DIR}/empty-identity.txt",
+      )
+      assert result == "hello from keyring", f"keyring: {result!r}"
+
       # ── locked mode without identity (store path already cached) ──
 
       result = nix_eval(